@@ -0,0 +1,197 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ The librsl string helpers and escapestr(), each next to a replacement that doesn't allocate or scan its input twice,
+ in ns/op and allocations/op. Allocations are counted by linking with --wrap=malloc, see the Makefile.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "librsl.h"
+
+#define ITERATIONS 1000000
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+static unsigned long allocs;
+
+void *__wrap_malloc(size_t size) {
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	allocs++;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+	allocs++;
+	return __real_realloc(p, size);
+}
+
+static volatile long sink;
+
+static const char *methods[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH"};
+static char reqline[] = "GET /assets/css/main.css?v=1697049212 HTTP/1.1";
+static char path[] = "/srv/public/assets/css/main.css";
+static char phppath[] = "/srv/public/api/login.php";
+static char root[] = "/srv/public";
+static char target[] = "/assets/css/main.css";
+static char ip[] = "192.168.100.254";
+static unsigned char cachekey[] = "/news/2024/07/18/some-rather-long-article-title.html?page=2&lang=en";
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+	return (b->tv_sec-a->tv_sec) + (b->tv_nsec-a->tv_nsec)/1e9;
+}
+
+/* The T-th token of S, found in place: its start, and its length in LEN */
+static const char *ntoken_r(const char *s, const char *d, int t, int *len) {
+	s += strspn(s, d);
+	for (int i=0; i<t && *s; i++) {
+		s += strcspn(s, d);
+		s += strspn(s, d);
+	}
+	*len = strcspn(s, d);
+	return *len ? s : NULL;
+}
+
+/* Only C's length is needed; startswith() also measures S */
+static int startswith_n(const char *s, const char *c) {
+	return !strncmp(s, c, strlen(c));
+}
+
+/* Also safe when END is longer than S, where endswith() reads before S */
+static int endswith_n(const char *s, const char *end) {
+	size_t ls = strlen(s), le = strlen(end);
+	return ls >= le && !memcmp(s+ls-le, end, le);
+}
+
+/* Compares the first byte before calling strcmp() */
+static int needle_c(const char *n, const char **h, int lh) {
+	for (int i=0; i<lh; i++) {
+		if (h[i][0] == n[0] && !strcmp(h[i], n)) return i;
+	}
+	return -1;
+}
+
+/* Measures both strings once, combine() goes over A again in strcat() */
+static char *combine_n(const char *a, const char *b) {
+	size_t la = strlen(a), lb = strlen(b);
+	char *buffer = malloc(la+lb+1);
+	memcpy(buffer, a, la);
+	memcpy(buffer+la, b, lb+1);
+	return buffer;
+}
+
+static uint32_t parse_ip_pton(const char *s) {
+	struct in_addr a;
+	return inet_pton(AF_INET, s, &a) == 1 ? ntohl(a.s_addr) : 0;
+}
+
+/* escapestr() into the caller's buffer: no 8K malloc() and memset(), and strlen() once instead of every byte */
+static int escapestr_r(const unsigned char *s, char *o) {
+	int oi = 0;
+
+	for (int i=0; s[i];) {
+		int j = i;
+		while (s[j] && s[j] != '/' && s[j] < 0x80 && s[j] > 0x1f && j-i < 25) j++;
+		if (j > i) {
+			o[oi++] = 'A'+(j-i);
+			memcpy(o+oi, s+i, j-i);
+			oi += j-i;
+			i = j;
+		} else {
+			o[oi++] = (s[i]>>4)+'a';
+			o[oi++] = (s[i]%16)+'a';
+			i++;
+		}
+	}
+	o[oi] = 0;
+	return oi;
+}
+
+/* Run BODY ITERATIONS times; prints the time and allocations per run */
+#define BENCH(label, body) do { \
+	struct timespec start, end; \
+	unsigned long before = allocs; \
+	clock_gettime(CLOCK_MONOTONIC, &start); \
+	for (int it=0; it<ITERATIONS; it++) { body; } \
+	clock_gettime(CLOCK_MONOTONIC, &end); \
+	printf("%-32s %10.1f ns/op %8.2f allocs/op\n", label, elapsed(&start, &end)*1e9/ITERATIONS, (double)(allocs-before)/ITERATIONS); \
+} while (0)
+
+static void fail(const char *what) {
+	fprintf(stderr, "%s: replacement disagrees\n", what);
+	exit(1);
+}
+
+int main() {
+	char buf[BUFSIZ];
+	int len;
+
+	/* Replacements have to give the same answers before either is timed */
+	char *tk = ntoken(reqline, " ", 1);
+	const char *tr = ntoken_r(reqline, " ", 1, &len);
+	if (!tk || !tr || strlen(tk) != len || memcmp(tk, tr, len)) fail("ntoken");
+	if (startswith(path, root) != startswith_n(path, root) || startswith(target, root) != startswith_n(target, root)) fail("startswith");
+	if (endswith(phppath, ".php") != endswith_n(phppath, ".php") || endswith(path, ".php") != endswith_n(path, ".php")) fail("endswith");
+	if (needle("PATCH", (char **)methods, 9) != needle_c("PATCH", methods, 9)) fail("needle");
+	char *c1 = combine(root, target), *c2 = combine_n(root, target);
+	if (strcmp(c1, c2)) fail("combine");
+	free(c1);
+	free(c2);
+	if (parse_ip(ip) != parse_ip_pton(ip)) fail("parse_ip");
+	char *e = escapestr(cachekey);
+	escapestr_r(cachekey, buf);
+	if (strcmp(e, buf)) fail("escapestr");
+	free(e);
+
+	printf("librsl: %d iterations\n", ITERATIONS);
+
+	//ntoken() loses the start of its copy for every token but the first, so each call leaks it
+	BENCH("ntoken, 2nd of request line", sink = (long)ntoken(reqline, " ", 1));
+	BENCH("  in place", sink = (long)ntoken_r(reqline, " ", 1, &len));
+
+	BENCH("startswith, root prefix", sink = startswith(path, root));
+	BENCH("  prefix length only", sink = startswith_n(path, root));
+
+	BENCH("endswith, .php", sink = endswith(phppath, ".php"));
+	BENCH("  length-checked memcmp", sink = endswith_n(phppath, ".php"));
+
+	BENCH("needle, last of 9 methods", sink = needle("PATCH", (char **)methods, 9));
+	BENCH("  first byte first", sink = needle_c("PATCH", methods, 9));
+
+	BENCH("combine, root and target", { char *p = combine(root, target); sink = p[0]; free(p); });
+	BENCH("  lengths once", { char *p = combine_n(root, target); sink = p[0]; free(p); });
+
+	BENCH("parse_ip, dotted quad", sink = parse_ip(ip));
+	BENCH("  inet_pton", sink = parse_ip_pton(ip));
+
+	BENCH("escapestr, 67-byte URL", { char *p = escapestr(cachekey); sink = p[0]; free(p); });
+	BENCH("  into a buffer", sink = escapestr_r(cachekey, buf));
+
+	return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ HTTP load generator: keeps CONNECTIONS keep-alive connections busy with GET requests for a while, each sending
+ its next request as soon as the previous response is complete, and prints throughput and latency as one JSON object.
+ Being closed-loop, it measures how long responses take under load, not how long a request waits to be sent.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SUB 4 //Histogram buckets per power of two nanoseconds, as a power of two: within 6%
+#define NBUCKETS 1024
+#define BUFLEN 65536
+#define MAXCODE 600
+
+enum {
+	PHASE_HEAD,
+	PHASE_LENGTH, //Body with a Content-Length
+	PHASE_CHUNKSIZE,
+	PHASE_CHUNK, //Chunk data and its CRLF
+	PHASE_TRAILER,
+	PHASE_CLOSE //Body up to the end of the connection
+};
+
+typedef struct {
+	int fd;
+	char buf[BUFLEN];
+	int len;
+	int phase;
+	long remaining;
+	int status;
+	bool close;
+	long start;
+} Conn;
+
+typedef struct {
+	pthread_t thread;
+	int nconns;
+	unsigned long requests, errors, mismatches, bytes, connects;
+	unsigned long codes[MAXCODE];
+	unsigned long buckets[NBUCKETS];
+	unsigned long sum, max;
+} Thread;
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static char request[4096];
+static int requestlen;
+static int expectstatus;
+static long deadline;
+
+static long clockns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static int bucket(unsigned long v) {
+	if (v < (1 << SUB)) return v;
+	int e = 63-__builtin_clzl(v);
+	return ((e-SUB+1) << SUB) + (v >> (e-SUB) & ((1 << SUB)-1));
+}
+
+/* Largest value that lands in bucket I */
+static unsigned long bucketmax(int i) {
+	if (i < (1 << SUB)) return i;
+	int e = (i >> SUB)+SUB-1;
+	return (((1UL << SUB) + (i & ((1 << SUB)-1))) << (e-SUB)) + (1UL << (e-SUB)) - 1;
+}
+
+/* Send the request, opening the connection first if needed; false if the server can't be reached */
+static bool sendreq(Thread *t, int epfd, Conn *c) {
+	if (c->fd < 0) {
+		int one = 1;
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+
+		//Connections are blocking, only reads are done without waiting; connecting to a local server is immediate
+		if ((c->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return false;
+		if (connect(c->fd, (struct sockaddr *)&addr, addrlen) || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev)) {
+			close(c->fd);
+			c->fd = -1;
+			return false;
+		}
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		t->connects++;
+	}
+
+	c->len = 0;
+	c->phase = PHASE_HEAD;
+	c->start = clockns();
+	if (send(c->fd, request, requestlen, MSG_NOSIGNAL) != requestlen) {
+		close(c->fd);
+		c->fd = -1;
+		return false;
+	}
+	return true;
+}
+
+static void reset(Conn *c) {
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void done(Thread *t, int epfd, Conn *c, bool ok) {
+	long ns = clockns()-c->start;
+
+	if (ok) {
+		t->requests++;
+		t->sum += ns;
+		t->max = ns > t->max ? ns : t->max;
+		t->buckets[bucket(ns)]++;
+		if (c->status > 0 && c->status < MAXCODE) t->codes[c->status]++;
+		if (expectstatus && c->status != expectstatus) t->mismatches++;
+	} else {
+		t->errors++;
+	}
+
+	if (!ok || c->close) reset(c);
+	if (clockns() < deadline && !sendreq(t, epfd, c)) t->errors++;
+}
+
+/* Parse the status line and headers at the start of the buffer; -1 if they are incomplete, 0 if malformed */
+static int head(Conn *c) {
+	char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+	bool chunked = false;
+	long length = -1;
+
+	if (!end) return c->len == BUFLEN ? 0 : -1;
+	*end = 0;
+
+	if (strncmp(c->buf, "HTTP/1.", 7) || c->len < 12) return 0;
+	c->status = strtol(c->buf+9, NULL, 10);
+	c->close = c->buf[7] == '0';
+
+	for (char *line = strstr(c->buf, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (!strncasecmp(line, "Content-Length:", 15)) length = strtol(line+15, NULL, 10);
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18)) chunked = strcasestr(line, "chunked") != NULL;
+		else if (!strncasecmp(line, "Connection:", 11)) c->close = strcasestr(line, "close") != NULL;
+	}
+
+	if (c->status == 204 || c->status == 304 || c->status < 200) c->phase = PHASE_LENGTH, c->remaining = 0;
+	else if (chunked) c->phase = PHASE_CHUNKSIZE;
+	else if (length >= 0) c->phase = PHASE_LENGTH, c->remaining = length;
+	else c->phase = PHASE_CLOSE, c->close = true;
+
+	return end+4-c->buf;
+}
+
+static void drop(Conn *c, int n) {
+	memmove(c->buf, c->buf+n, c->len-n);
+	c->len -= n;
+}
+
+/* Go through what has been received; true once the response is complete */
+static bool parse(Thread *t, Conn *c, bool *bad) {
+	while (true) {
+		char *eol;
+		int n;
+
+		switch (c->phase) {
+			case PHASE_HEAD:
+				if ((n = head(c)) < 0) return false;
+				if (!n) {
+					*bad = true;
+					return true;
+				}
+				drop(c, n);
+				break;
+			case PHASE_LENGTH:
+			case PHASE_CHUNK:
+				n = c->remaining < c->len ? c->remaining : c->len;
+				t->bytes += n;
+				c->remaining -= n;
+				drop(c, n);
+				if (c->remaining) return false;
+				if (c->phase == PHASE_LENGTH) return true;
+				c->phase = PHASE_CHUNKSIZE;
+				break;
+			case PHASE_CHUNKSIZE:
+				if (!(eol = memmem(c->buf, c->len, "\r\n", 2))) return false;
+				c->remaining = strtol(c->buf, NULL, 16);
+				drop(c, eol+2-c->buf);
+				if (c->remaining) c->remaining += 2;
+				c->phase = c->remaining ? PHASE_CHUNK : PHASE_TRAILER;
+				break;
+			case PHASE_TRAILER:
+				if (!(eol = memmem(c->buf, c->len, "\r\n", 2))) return false;
+				n = eol-c->buf;
+				drop(c, n+2);
+				if (!n) return true;
+				break;
+			case PHASE_CLOSE:
+				t->bytes += c->len;
+				c->len = 0;
+				return false;
+		}
+	}
+}
+
+static void onreadable(Thread *t, int epfd, Conn *c) {
+	while (c->fd >= 0) {
+		ssize_t n = recv(c->fd, c->buf+c->len, BUFLEN-c->len, MSG_DONTWAIT);
+		bool bad = false;
+
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if (n <= 0) {
+			//Closing ends a body without a length, anything else was cut short
+			done(t, epfd, c, c->phase == PHASE_CLOSE);
+			return;
+		}
+
+		c->len += n;
+		if (parse(t, c, &bad)) done(t, epfd, c, !bad);
+	}
+}
+
+static void *threadmain(void *arg) {
+	Thread *t = arg;
+	struct epoll_event events[64];
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	Conn *conns = calloc(t->nconns, sizeof(Conn));
+
+	if (epfd < 0 || !conns) {
+		perror("epoll_create1()");
+		exit(1);
+	}
+
+	for (int i=0; i<t->nconns; i++) {
+		conns[i].fd = -1;
+		if (!sendreq(t, epfd, &conns[i])) {
+			perror("connect()");
+			exit(1);
+		}
+	}
+
+	while (clockns() < deadline) {
+		int n = epoll_wait(epfd, events, 64, 100);
+		for (int i=0; i<n; i++) onreadable(t, epfd, events[i].data.ptr);
+
+		//Connections lost between requests are opened again
+		for (int i=0; i<t->nconns; i++) {
+			if (conns[i].fd < 0 && clockns() < deadline && !sendreq(t, epfd, &conns[i])) t->errors++;
+		}
+	}
+
+	for (int i=0; i<t->nconns; i++) {
+		if (conns[i].fd >= 0) close(conns[i].fd);
+	}
+	free(conns);
+	close(epfd);
+	return NULL;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-c connections] [-t threads] [-d seconds] [-s status] [-H header] <host:port> <path>\n", name);
+	printf("  -c [connections]     keep [connections] connections busy (default 16)\n");
+	printf("  -t [threads]         spread them over [threads] threads (default up to 4)\n");
+	printf("  -d [seconds]         run for [seconds] (default 5)\n");
+	printf("  -s [status]          count responses with another status as mismatches\n");
+	printf("  -H [header]          add [header] to every request\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int nconns = 16, nthreads = 0, opt;
+	double seconds = 5;
+	char headers[2048] = "";
+	int headerslen = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:d:s:H:")) != -1) {
+		switch (opt) {
+			case 'c': nconns = strtol(optarg, NULL, 0); break;
+			case 't': nthreads = strtol(optarg, NULL, 0); break;
+			case 'd': seconds = strtod(optarg, NULL); break;
+			case 's': expectstatus = strtol(optarg, NULL, 0); break;
+			case 'H': headerslen += snprintf(headers+headerslen, sizeof(headers)-headerslen, "%s\r\n", optarg); break;
+			default: usage(argv[0]);
+		}
+		if (headerslen >= sizeof(headers)) usage(argv[0]);
+	}
+	if (argc-optind != 2 || nconns < 1 || seconds <= 0) usage(argv[0]);
+	if (nthreads < 1) nthreads = nconns < 4 ? nconns : 4;
+	if (nthreads > nconns) nthreads = nconns;
+
+	char *host = strdup(argv[optind]), *port = strrchr(host, ':');
+	struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *ai;
+	if (!port) usage(argv[0]);
+	*port++ = 0;
+	if (getaddrinfo(host, port, &hints, &ai)) {
+		fprintf(stderr, "%s: unknown host\n", argv[optind]);
+		return 1;
+	}
+	memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+	addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	requestlen = snprintf(request, sizeof request, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", argv[optind+1], argv[optind], headers);
+	if (requestlen >= sizeof request) usage(argv[0]);
+
+	Thread *threads = calloc(nthreads, sizeof(Thread));
+	long start = clockns();
+	deadline = start + seconds*1e9;
+
+	for (int i=0; i<nthreads; i++) {
+		threads[i].nconns = nconns/nthreads + (i < nconns%nthreads);
+		if (pthread_create(&threads[i].thread, NULL, threadmain, &threads[i])) {
+			perror("pthread_create()");
+			return 1;
+		}
+	}
+
+	Thread total = {0};
+	for (int i=0; i<nthreads; i++) {
+		Thread *t = &threads[i];
+		pthread_join(t->thread, NULL);
+		total.requests += t->requests;
+		total.errors += t->errors;
+		total.mismatches += t->mismatches;
+		total.bytes += t->bytes;
+		total.connects += t->connects;
+		total.sum += t->sum;
+		total.max = t->max > total.max ? t->max : total.max;
+		for (int c=0; c<MAXCODE; c++) total.codes[c] += t->codes[c];
+		for (int b=0; b<NBUCKETS; b++) total.buckets[b] += t->buckets[b];
+	}
+	double elapsed = (clockns()-start)/1e9;
+
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	static const char *names[] = {"p50", "p90", "p99", "p999"};
+	double values[4] = {0};
+	for (int q=0; q<4; q++) {
+		unsigned long rank = quantiles[q]*total.requests, seen = 0;
+		for (int b=0; b<NBUCKETS; b++) {
+			seen += total.buckets[b];
+			if (seen > rank) {
+				values[q] = (bucketmax(b) < total.max ? bucketmax(b) : total.max)/1e3;
+				break;
+			}
+		}
+	}
+
+	printf("{\"connections\":%d,\"threads\":%d,\"seconds\":%.3f,\"requests\":%lu,\"errors\":%lu,\"mismatches\":%lu,\"connects\":%lu,"
+		"\"requests_per_second\":%.1f,\"bytes_per_second\":%.0f,\"latency_us\":{\"mean\":%.1f",
+		nconns, nthreads, elapsed, total.requests, total.errors, total.mismatches, total.connects,
+		total.requests/elapsed, total.bytes/elapsed, total.requests ? total.sum/1e3/total.requests : 0.0);
+	for (int q=0; q<4; q++) printf(",\"%s\":%.1f", names[q], values[q]);
+	printf(",\"max\":%.1f},\"status\":{", total.max/1e3);
+	for (int c=0, first=1; c<MAXCODE; c++) {
+		if (!total.codes[c]) continue;
+		printf("%s\"%d\":%lu", first ? "" : ",", c, total.codes[c]);
+		first = 0;
+	}
+	printf("}}\n");
+	return 0;
+}
@@ -0,0 +1,182 @@
+#Tiger, a web server built for being really fast and powerful.
+#Copyright (C) 2023 kevidryon2
+#
+#This program is free software: you can redistribute it and/or modify
+#it under the terms of the GNU Affero General Public License as
+#published by the Free Software Foundation, either version 3 of the
+#License, or (at your option) any later version.
+#
+#This program is distributed in the hope that it will be useful,
+#but WITHOUT ANY WARRANTY; without even the implied warranty of
+#MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#GNU Affero General Public License for more details.
+#
+#You should have received a copy of the GNU Affero General Public License
+#along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Load test: starts Tiger on a copy of test/, checks every scenario answers what it should,
+# then runs build/loadgen against each at several concurrencies and writes the results as JSON.
+# Results from two commits can be compared with --compare.
+
+import argparse
+import hashlib
+import http.client
+import json
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+LARGE = 4 << 20 #Bytes in the large file
+PHP_BODY = b"".join(b"tiger %d\n" % (i*i) for i in range(1, 17)) #What test/public/load.php prints
+
+# name: (path, expected status, expected body or None to take it from public/, needs PHP)
+SCENARIOS = {
+    "small": ("/index.html", 200, None, False),
+    "large": ("/large.bin", 200, None, False),
+    "404": ("/missing.html", 404, None, False),
+    "php": ("/load.php", 200, PHP_BODY, True),
+    "script": ("/ping", 200, b"pong", False),
+}
+
+def freeport():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+def maketree():
+    """A copy of test/ with a large file added, so the repository is left alone"""
+    tree = tempfile.mkdtemp(prefix="tiger-load-")
+    for d in ("public", "scripts", "cache"):
+        shutil.copytree(os.path.join(ROOT, "test", d), os.path.join(tree, d))
+    with open(os.path.join(tree, "public", "large.bin"), "wb") as f:
+        f.write(bytes(i*7 % 251 for i in range(LARGE)))
+    return tree
+
+def start(tiger, tree, port, args):
+    log = open(os.path.join(tree, "tiger.log"), "w")
+    proc = subprocess.Popen([tiger, "-p", str(port), "-l", "off"] + args, cwd=tree, stdout=log, stderr=subprocess.STDOUT)
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.1).close()
+            return proc
+        except OSError:
+            if proc.poll() is not None:
+                break
+            time.sleep(0.05)
+    sys.exit("Tiger didn't start, see " + log.name)
+
+def fetch(port, path):
+    conn = http.client.HTTPConnection("127.0.0.1", port, timeout=10)
+    conn.request("GET", path)
+    r = conn.getresponse()
+    body = r.read()
+    conn.close()
+    return r.status, body
+
+def verify(port, tree, name):
+    """What test/bin/test.py used to do: the body has to hash the same as the file it comes from"""
+    path, status, expected, _ = SCENARIOS[name]
+    if expected is None:
+        with open(os.path.join(tree, "public", "404.html" if status == 404 else path[1:]), "rb") as f:
+            expected = f.read()
+    got, body = fetch(port, path)
+    return got == status and hashlib.sha1(body).digest() == hashlib.sha1(expected).digest()
+
+def commit():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], cwd=ROOT, capture_output=True, text=True).stdout.strip() or "unknown"
+    except OSError:
+        return "unknown"
+
+def change(new, old):
+    return (new/old-1)*100 if old else 0.0
+
+def compare(old, new):
+    """Print the change from OLD to NEW for every run both have"""
+    before = {(r["scenario"], r["connections"]): r for r in old["results"]}
+    print("%-8s %6s %14s %14s %14s" % ("scenario", "conns", "req/s", "p50", "p99"))
+    for r in new["results"]:
+        o = before.get((r["scenario"], r["connections"]))
+        if not o:
+            continue
+        print("%-8s %6d %+13.1f%% %+13.1f%% %+13.1f%%" % (r["scenario"], r["connections"],
+            change(r["requests_per_second"], o["requests_per_second"]),
+            change(r["latency_us"]["p50"], o["latency_us"]["p50"]),
+            change(r["latency_us"]["p99"], o["latency_us"]["p99"])))
+
+def main():
+    p = argparse.ArgumentParser(description="Load test Tiger against the test/ tree")
+    p.add_argument("--tiger", default=os.path.join(ROOT, "build", "tiger-x86_64"))
+    p.add_argument("--loadgen", default=os.path.join(ROOT, "build", "loadgen"))
+    p.add_argument("--scenarios", default=",".join(SCENARIOS))
+    p.add_argument("--connections", default="1,16,64")
+    p.add_argument("--duration", type=float, default=3)
+    p.add_argument("--workers", type=int, default=os.cpu_count() // 2 or 1)
+    p.add_argument("--out", help="where to write the results (default build/load-<commit>.json)")
+    p.add_argument("--compare", help="results of an earlier run to compare with")
+    args = p.parse_args()
+
+    tree = maketree()
+    port = freeport()
+    tigerargs = ["-w", str(args.workers)]
+    #PHP runs through php-cgi when it is there, otherwise a php process per request
+    php = shutil.which("php-cgi") or shutil.which("php")
+    if php and php.endswith("php-cgi"):
+        tigerargs += ["-F", "2"]
+
+    proc = start(os.path.abspath(args.tiger), tree, port, tigerargs)
+    results = []
+    failed = False
+    try:
+        for name in args.scenarios.split(","):
+            path, status, _, needsphp = SCENARIOS[name]
+            if needsphp and not php:
+                print("%-8s skipped, PHP is not installed" % name, file=sys.stderr)
+                continue
+            if not verify(port, tree, name):
+                print("%-8s FAIL: wrong response for %s" % (name, path), file=sys.stderr)
+                failed = True
+                continue
+
+            for conns in [int(c) for c in args.connections.split(",")]:
+                out = subprocess.run([args.loadgen, "-c", str(conns), "-d", str(args.duration), "-s", str(status),
+                    "127.0.0.1:%d" % port, path], capture_output=True, text=True, check=True).stdout
+                r = json.loads(out)
+                r["scenario"] = name
+                r["path"] = path
+                results.append(r)
+                print("%-8s %4d conns %10.0f req/s  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  errors %d" % (name, conns,
+                    r["requests_per_second"], r["latency_us"]["p50"], r["latency_us"]["p99"], r["latency_us"]["p999"],
+                    r["errors"]+r["mismatches"]))
+                failed |= bool(r["errors"] or r["mismatches"])
+    finally:
+        proc.terminate()
+        proc.wait()
+        shutil.rmtree(tree)
+
+    report = {
+        "commit": commit(),
+        "date": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "host": {"cpus": os.cpu_count(), "kernel": os.uname().release},
+        "tiger_args": tigerargs,
+        "duration": args.duration,
+        "results": results,
+    }
+    out = args.out or os.path.join(ROOT, "build", "load-%s.json" % report["commit"])
+    with open(out, "w") as f:
+        json.dump(report, f, indent=1)
+    print("Results written to", out)
+
+    if args.compare:
+        with open(args.compare) as f:
+            compare(json.load(f), report)
+
+    sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,98 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Request parser throughput, in requests parsed per second */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "server.h"
+
+#define ITERATIONS 1000000
+
+static const char *requests[] = {
+	"GET / HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n",
+
+	"GET /assets/css/main.css?v=1697049212 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Accept: text/css,*/*;q=0.1\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: style\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9,it;q=0.8\r\n"
+	"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.1.1234567890.1697049212\r\n"
+	"If-None-Match: \"11e039-dab-6698fc2f\"\r\n"
+	"If-Modified-Since: Thu, 18 Jul 2024 11:27:43 GMT\r\n"
+	"\r\n",
+
+	"POST /api/login.php HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Content-Type: application/x-www-form-urlencoded\r\n"
+	"Content-Length: 27\r\n"
+	"\r\n"
+	"user=kevin&password=hunter2",
+};
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+	return (b->tv_sec-a->tv_sec) + (b->tv_nsec-a->tv_nsec)/1e9;
+}
+
+/* Parse REQ delivered CHUNK bytes at a time, like a slow client would send it */
+static void bench(const char *name, const char *req, int chunk) {
+	RequestData parsed;
+	struct timespec start, end;
+	int len = strlen(req);
+	int r = PARSE_AGAIN;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<ITERATIONS; i++) {
+		TigerResetRequest(&parsed);
+		for (int got = chunk; ; got += chunk) {
+			r = TigerParseRequest(&parsed, req, min(got, len));
+			if (r != PARSE_AGAIN || got >= len) break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (r != PARSE_DONE) {
+		fprintf(stderr, "%s: parse failed (%d)\n", name, parsed.error);
+		exit(1);
+	}
+
+	double t = elapsed(&start, &end);
+	printf("%-28s %5d bytes %12.0f req/s %8.1f ns/req\n", name, len, ITERATIONS/t, t*1e9/ITERATIONS);
+}
+
+int main() {
+	printf("parse: %d iterations\n", ITERATIONS);
+	bench("minimal", requests[0], 1<<20);
+	bench("browser", requests[1], 1<<20);
+	bench("browser, 64-byte reads", requests[1], 64);
+	bench("post", requests[2], 1<<20);
+	return 0;
+}
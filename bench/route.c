@@ -0,0 +1,125 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Script route matching: the old fnmatch() over every pattern against the route index, as routes are added */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <time.h>
+#include "server.h"
+
+#define MAX_ROUTES 4096
+#define NPATHS 64
+#define BUDGET 20000000 //Pattern checks per linear run, so large tables don't take forever
+
+static char *patterns[MAX_ROUTES];
+static char *paths[NPATHS];
+static volatile int sink;
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+	return (b->tv_sec-a->tv_sec) + (b->tv_nsec-a->tv_nsec)/1e9;
+}
+
+/* A mix of the shapes scripts use: literal, trailing star, inner star, ? and brackets */
+static void makeroutes() {
+	for (int i=0; i<MAX_ROUTES; i++) {
+		char buf[128];
+		switch (i % 5) {
+			case 0: snprintf(buf, sizeof buf, "/api/v%d/users/*", i); break;
+			case 1: snprintf(buf, sizeof buf, "/page%d", i); break;
+			case 2: snprintf(buf, sizeof buf, "/static/%d/*.css", i); break;
+			case 3: snprintf(buf, sizeof buf, "/files/[a-m]%d/doc?.txt", i); break;
+			case 4: snprintf(buf, sizeof buf, "/ping%d*", i); break;
+		}
+		patterns[i] = strdup(buf);
+	}
+}
+
+/* Requests for routes anywhere in the table, plus misses */
+static void makepaths(int nroutes) {
+	for (int i=0; i<NPATHS; i++) {
+		int r = (i*7919) % nroutes;
+		char buf[128];
+		switch (i % 6) {
+			case 0: snprintf(buf, sizeof buf, "/api/v%d/users/42/profile", r - r%5); break;
+			case 1: snprintf(buf, sizeof buf, "/page%d", r - r%5 + 1); break;
+			case 2: snprintf(buf, sizeof buf, "/static/%d/theme/main.css", r - r%5 + 2); break;
+			case 3: snprintf(buf, sizeof buf, "/files/c%d/doc7.txt", r - r%5 + 3); break;
+			case 4: snprintf(buf, sizeof buf, "/ping%d/anything", r - r%5 + 4); break;
+			case 5: snprintf(buf, sizeof buf, "/missing/%d/index.html", r); break;
+		}
+		free(paths[i]);
+		paths[i] = strdup(buf);
+	}
+}
+
+/* What TigerSearchScript() did before: every pattern of every script, in order */
+static int linear(int nroutes, const char *path) {
+	for (int i=0; i<nroutes; i++) {
+		if (fnmatch(patterns[i], path, 0) != FNM_NOMATCH) return i;
+	}
+	return -1;
+}
+
+int main() {
+	const int sizes[] = {16, 256, 1024, 4096};
+	struct timespec start, end;
+
+	makeroutes();
+	printf("route: %d paths per round\n", NPATHS);
+	printf("%-8s %14s %14s\n", "routes", "fnmatch", "index");
+
+	for (int k=0; k<sizeof(sizes)/sizeof(sizes[0]); k++) {
+		int n = sizes[k];
+		RouteIndex *idx = TigerRouteNew();
+
+		for (int i=0; i<n; i++) TigerRouteAdd(idx, patterns[i], i);
+		makepaths(n);
+
+		/* Both have to agree before either is timed */
+		for (int i=0; i<NPATHS; i++) {
+			if (linear(n, paths[i]) != TigerRouteMatch(idx, paths[i])) {
+				printf("mismatch on %s: fnmatch %d, index %d\n", paths[i], linear(n, paths[i]), TigerRouteMatch(idx, paths[i]));
+				return 1;
+			}
+		}
+
+		int rounds = BUDGET / (n*NPATHS) + 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int r=0; r<rounds; r++) {
+			for (int i=0; i<NPATHS; i++) sink = linear(n, paths[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double tlinear = elapsed(&start, &end)*1e9/(rounds*NPATHS);
+
+		rounds = 100000;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int r=0; r<rounds; r++) {
+			for (int i=0; i<NPATHS; i++) sink = TigerRouteMatch(idx, paths[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double tindex = elapsed(&start, &end)*1e9/(rounds*NPATHS);
+
+		printf("%-8d %11.1f ns %11.1f ns\n", n, tlinear, tindex);
+		TigerRouteFree(idx);
+	}
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Delimiter scanning: the old ntoken()/strtok() splitting against each TigerScanLine() kernel */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "server.h"
+
+#define ITERATIONS 1000000
+
+static const char request[] =
+	"GET /assets/css/main.css?v=1697049212 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Accept: text/css,*/*;q=0.1\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: style\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9,it;q=0.8\r\n"
+	"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.1.1234567890.1697049212\r\n"
+	"If-None-Match: \"11e039-dab-6698fc2f\"\r\n"
+	"If-Modified-Since: Thu, 18 Jul 2024 11:27:43 GMT\r\n"
+	"\r\n";
+
+static volatile int sink;
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+	return (b->tv_sec-a->tv_sec) + (b->tv_nsec-a->tv_nsec)/1e9;
+}
+
+/*
+ What the old parser did: copy the buffer and strtok() it into lines, then copy
+ each line and strtok() it on ':'. Same work as ntoken(), but the copies are freed.
+*/
+static int splitntoken(const char *req) {
+	char *lines = strdup(req), *save, *line;
+	int n = 0;
+
+	for (line = strtok_r(lines, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+		char *copy = strdup(line), *hsave;
+		if (strtok_r(copy, ":", &hsave)) n++;
+		free(copy);
+	}
+	free(lines);
+	return n;
+}
+
+static int splitscan(const char *req, int len) {
+	int n = 0;
+
+	for (int pos = 0, end; pos < len; pos = end+1) {
+		int colon = -1;
+		if ((end = TigerScanLine(req, pos, len, &colon)) < 0) break;
+		n += colon >= 0;
+	}
+	return n;
+}
+
+static void report(const char *name, struct timespec *start, struct timespec *end) {
+	double t = elapsed(start, end);
+	printf("%-24s %12.0f req/s %8.1f ns/req\n", name, ITERATIONS/t, t*1e9/ITERATIONS);
+}
+
+int main() {
+	const char *names[] = {"scalar", "sse2", "avx2"};
+	struct timespec start, end;
+	char label[64];
+	int len = strlen(request);
+
+	printf("scan: %d iterations, %d bytes\n", ITERATIONS, len);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<ITERATIONS; i++) sink = splitntoken(request);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	report("ntoken", &start, &end);
+
+	for (int k=0; k<sizeof(names)/sizeof(names[0]); k++) {
+		if (!TigerScanSelect(names[k])) {
+			printf("%-24s unsupported\n", names[k]);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i=0; i<ITERATIONS; i++) sink = splitscan(request, len);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		snprintf(label, sizeof label, "scan %s", names[k]);
+		report(label, &start, &end);
+
+		RequestData req;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i=0; i<ITERATIONS; i++) {
+			TigerResetRequest(&req);
+			sink = TigerParseRequest(&req, request, len);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		snprintf(label, sizeof label, "parse %s", names[k]);
+		report(label, &start, &end);
+	}
+
+	return 0;
+}
@@ -18,14 +18,43 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 #pragma once
 
+/* A decoded instruction; HANDLER is the interpreter label it runs, see TigerExecScript() */
 typedef struct {
-  char *paths[16];
-  int supp_methods[8];
-  char script[BUFSIZ];
+	const void *handler;
+	int arg;
+	const char *str; //String packets point into the script's code
+	int len;
+} NSOp;
+
+typedef struct {
+  char *paths[16]; //Glob patterns, NULL-terminated unless all are used
+  unsigned char supp_methods[8]; //Nonzero for each verb the script answers
+  char *code;
+  int codelen;
+  NSOp *ops; //Ends with an end-of-script op
+  int nops;
+  bool inbundle; //Paths, code and ops belong to a bundle of the table, not to the script
 } LoadedScript;
 
+/* A bundle's contents, read from its file, and the ops of all its scripts */
+typedef struct {
+	char *data;
+	size_t len;
+	NSOp *ops;
+} ScriptBundle;
+
+/* Everything loaded from scripts/; replaced as a whole when the directory changes, see TigerSetScripts() */
+typedef struct {
+	LoadedScript *scripts;
+	int nscripts;
+	struct RouteIndex *routes;
+	ScriptBundle *bundles;
+	int nbundles;
+} ScriptTable;
+
 typedef struct {
 	char magic[4]; //Always 'nets'
 	unsigned char ver_major;
@@ -41,10 +70,41 @@ typedef enum {
 	INST_STRING_PACKET	= 0x1e //Followed by a zero-terminated string
 } NSInstID;
 
+/* Instructions are 4 bytes except INST_STRING_PACKET, whose string starts right after the ID; INST_RETURN answers with the 16-bit little-endian status in its data (0xffff for 200) and the string packets that follow */
 typedef struct {
 	unsigned char inst_id;
 	char data[3];
 } NSInstruction;
 
+/*
+ A bundle of compiled scripts (netc -b), read whole by Tiger and used in place.
+ Offsets are from the start of the file and multiples of 4; numbers are in the host's byte order.
+*/
+typedef struct {
+	char magic[4]; //Always 'netb'
+	unsigned char ver_major;
+	unsigned char ver_minor;
+	unsigned short reserved;
+	unsigned int checksum; //FNV-1a of everything after the header
+	unsigned int scripts, nscripts; //Table of NSBundleScript
+	unsigned int routes, nroutes; //Table of pattern offsets into the string pool, in match order
+	unsigned int strings, stringslen; //Zero-terminated patterns
+	unsigned int code, codelen; //Instructions of every script, back to back
+} NSBundleHeader;
+
+typedef struct {
+	unsigned int code, codelen; //Relative to the bundle's code
+	unsigned int route, nroutes; //The script's patterns in the route table, at most 16
+	unsigned char supp_methods[8];
+} NSBundleScript;
+
+/* Checksum of a bundle's contents, see NSBundleHeader */
+static inline unsigned int NSChecksum(const void *data, size_t len) {
+	const unsigned char *p = data;
+	unsigned int h = 2166136261u;
+	for (size_t i=0; i<len; i++) h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
 #define NETC_VERSION_MAJOR 0x00
 #define NETC_VERSION_MINOR 0x05
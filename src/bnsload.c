@@ -19,18 +19,119 @@
 #include "bns.h"
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
 #include "server.h"
+#include "librsl.h"
+
+#define NS_MAX_PACKETS 64 //String packets one run can answer with
+
+extern char rootpath[];
+
+/* Interpreter handlers, in the order execops() lists their labels */
+enum {
+	OP_RETURN,
+	OP_STRING,
+	OP_END,
+	OP_COUNT
+};
+
+/*
+ Run the decoded ops of S for CONN, jumping straight from one handler to the next.
+ Called without a script, it hands out the handler addresses instead, so TigerLoadScript() can thread the ops through them.
+*/
+static const void *const *execops(LoadedScript *s, Connection *conn) {
+	static const void *const handlers[OP_COUNT] = {
+		[OP_RETURN] = &&op_return,
+		[OP_STRING] = &&op_string,
+		[OP_END] = &&op_end
+	};
+	const char *packets[NS_MAX_PACKETS];
+	int lens[NS_MAX_PACKETS];
+	int npackets = 0;
+	long bodylen = 0;
+	int status = 200;
+	NSOp *op;
+
+	if (!s) return handlers;
+
+	op = s->ops;
+	goto *op->handler;
+
+op_return:
+	status = op->arg == 0xffff ? 200 : op->arg;
+	if (status < 100 || status > 599) status = 500;
+	op++;
+	goto *op->handler;
+
+op_string:
+	if (npackets == NS_MAX_PACKETS) {
+		TigerErrorHandler(500, conn, rootpath);
+		return NULL;
+	}
+	packets[npackets] = op->str;
+	lens[npackets++] = op->len;
+	bodylen += op->len;
+	op++;
+	goto *op->handler;
+
+op_end:
+	TigerConnHeader(conn, status, bodylen, "Content-Type: text/plain\r\n");
+	for (int i=0; i<npackets; i++) TigerConnBody(conn, packets[i], lens[i]);
+	return NULL;
+}
+
+/* Decode CODE into threaded ops at OPS, which has room for codelen/2+1 of them: every op takes at least two bytes of code, plus one for the end. NOPs are dropped here and cost nothing at run time */
+static bool decode(LoadedScript *s, NSOp *ops) {
+	const void *const *handlers = execops(NULL, NULL);
+	int pos = 0;
+
+	s->ops = ops;
+	s->nops = 0;
+
+	while (pos < s->codelen) {
+		NSOp *op = &s->ops[s->nops];
+		unsigned char *inst = (unsigned char *)s->code+pos;
+
+		switch (inst[0]) {
+			case INST_NOP:
+				pos += sizeof(NSInstruction);
+				continue;
+			case INST_RETURN:
+				if (pos+sizeof(NSInstruction) > s->codelen) return false;
+				*op = (NSOp){handlers[OP_RETURN], inst[1] | inst[2] << 8};
+				pos += sizeof(NSInstruction);
+				break;
+			case INST_STRING_PACKET: {
+				char *end = memchr(s->code+pos+1, 0, s->codelen-pos-1);
+				if (!end) return false;
+				*op = (NSOp){handlers[OP_STRING], 0, s->code+pos+1, end-(s->code+pos+1)};
+				pos = end-s->code+1;
+				break;
+			}
+			default:
+				printf("(unknown instruction 0x%02x) ", inst[0]);
+				return false;
+		}
+		s->nops++;
+	}
+
+	s->ops[s->nops++] = (NSOp){handlers[OP_END]};
+	return true;
+}
 
 LoadedScript *TigerLoadScript(char *data, int len) {
+	NSHeader h;
+	LoadedScript *s;
 	
 	//If not enough bytes are contained in the file error out
 	if (len < sizeof(NSHeader))
 		goto notscript;
 	
-	//Allocate memory
-	NSHeader h;
-	LoadedScript *s = malloc(sizeof(LoadedScript));
-	
 	//Read header
 	memcpy(&h, data, sizeof(h));
 	
@@ -43,18 +144,36 @@ LoadedScript *TigerLoadScript(char *data, int len) {
 		printf("(warning: bad file version) ");
 	}
 	
-	char *p = h.paths;
+	if (!(s = calloc(1, sizeof(LoadedScript))) || !(s->code = malloc(len-sizeof(h)+1))) {
+		perror("malloc()");
+		exit(1);
+	}
+	
+	memcpy(s->supp_methods, h.supp_methods, sizeof(s->supp_methods));
 	
-	//Load paths
-	for (int i=0; p<h.paths+64; i++) {
-		s->paths[i] = malloc(strlen(p)+1);
-		if (strlen(p)) {
-			memcpy(s->paths[i], p, strlen(p)+1);
-		}
-		p += strlen(p)+1;
-	};
+	//Load paths, skipping empty ones
+	int n = 0;
+	for (char *p = h.paths; p < h.paths+sizeof(h.paths) && n < 16; ) {
+		int plen = strnlen(p, h.paths+sizeof(h.paths)-p);
+		if (plen && p+plen < h.paths+sizeof(h.paths)) s->paths[n++] = strndup(p, plen);
+		p += plen+1;
+	}
+	
+	s->codelen = len-sizeof(h);
+	memcpy(s->code, data+sizeof(h), s->codelen);
+	
+	if (!(s->ops = malloc((s->codelen/2+1)*sizeof(NSOp)))) {
+		perror("malloc()");
+		exit(1);
+	}
 	
-	memcpy(s->script, data+sizeof(h), len-sizeof(h));
+	if (!decode(s, s->ops)) {
+		for (int i=0; i<n; i++) free(s->paths[i]);
+		free(s->ops);
+		free(s->code);
+		free(s);
+		goto notscript;
+	}
 	
 	return s;
 	
@@ -63,6 +182,212 @@ notscript:
 	return NULL;
 }
 
-void TigerExecScript(LoadedScript scripts, RequestData reqdata, char *resbuff) {
-	
+/* Whether LEN bytes at OFF fit in SIZE */
+static bool inside(size_t off, size_t len, size_t size) {
+	return off <= size && len <= size-off;
+}
+
+/* Check the bundle at DATA and add its scripts to T; they keep pointing into it */
+static bool loadbundle(ScriptTable *t, char *data, size_t len) {
+	NSBundleHeader h;
+	LoadedScript *scripts;
+	NSOp *ops;
+
+	memcpy(&h, data, sizeof(h));
+	if (strncmp(h.magic, "netb", 4) || h.ver_major != NETC_VERSION_MAJOR) return false;
+	if (h.checksum != NSChecksum(data+sizeof(h), len-sizeof(h))) {
+		printf("(bad checksum) ");
+		return false;
+	}
+
+	//Every table has to be in the file and aligned, and the string pool has to end its last pattern
+	if (!h.nscripts || (h.scripts | h.routes | h.strings | h.code) & 3) return false;
+	if (!inside(h.scripts, (size_t)h.nscripts*sizeof(NSBundleScript), len) || !inside(h.routes, (size_t)h.nroutes*sizeof(unsigned int), len) ||
+		!inside(h.strings, h.stringslen, len) || !inside(h.code, h.codelen, len)) return false;
+	if (h.nroutes && (!h.stringslen || data[h.strings+h.stringslen-1])) return false;
+
+	//One block of scripts and one of ops, however many scripts there are
+	if (!(t->scripts = realloc(t->scripts, (t->nscripts+h.nscripts)*sizeof(LoadedScript))) ||
+		!(t->bundles = realloc(t->bundles, (t->nbundles+1)*sizeof(ScriptBundle))) ||
+		!(ops = malloc((h.codelen/2+h.nscripts)*sizeof(NSOp)))) {
+		perror("malloc()");
+		exit(1);
+	}
+	scripts = memset(t->scripts+t->nscripts, 0, h.nscripts*sizeof(LoadedScript));
+
+	const NSBundleScript *table = (NSBundleScript *)(data+h.scripts);
+	const unsigned int *routes = (unsigned int *)(data+h.routes);
+	size_t codeend = 0;
+
+	for (int i=0; i<h.nscripts; i++) {
+		const NSBundleScript *b = &table[i];
+		LoadedScript *s = &scripts[i];
+
+		if (!inside(b->code, b->codelen, h.codelen) || b->nroutes > 16 || !inside(b->route, b->nroutes, h.nroutes)) goto bad;
+		//OPS only has room for each byte of code decoded once, so code ranges have to come in order without overlapping, as netc writes them
+		if (b->code < codeend) goto bad;
+		codeend = (size_t)b->code+b->codelen;
+
+		memcpy(s->supp_methods, b->supp_methods, sizeof(s->supp_methods));
+		for (int j=0; j<b->nroutes; j++) {
+			if (routes[b->route+j] >= h.stringslen) goto bad;
+			s->paths[j] = data+h.strings+routes[b->route+j];
+		}
+
+		s->code = data+h.code+b->code;
+		s->codelen = b->codelen;
+		s->inbundle = true;
+		if (!decode(s, i ? scripts[i-1].ops+scripts[i-1].nops : ops)) goto bad;
+	}
+
+	t->bundles[t->nbundles++] = (ScriptBundle){data, len, ops};
+	t->nscripts += h.nscripts;
+	return true;
+
+bad:
+	free(ops);
+	return false;
+}
+
+/*
+ Read the bundle at PATH into memory and add all of its scripts to T; returns how many, or -1.
+ Their paths and code stay in that copy, so loading costs no allocation per script. The bundle isn't mapped: scripts/
+ is reloaded while the server runs, and a bundle rewritten in place under a mapping would raise SIGBUS in a worker.
+*/
+static int readbundle(ScriptTable *t, const char *path) {
+	struct stat st;
+	char *data;
+	size_t got = 0;
+	int fd, n = t->nscripts;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(NSBundleHeader) || st.st_size > UINT32_MAX) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(data = malloc(st.st_size))) {
+		perror("malloc()");
+		exit(1);
+	}
+	while (got < st.st_size) {
+		ssize_t r = pread(fd, data+got, st.st_size-got, got);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0) {
+			close(fd);
+			free(data);
+			return -1;
+		}
+		if (!r) break;
+		got += r;
+	}
+	close(fd);
+
+	//A bundle cut short while being read fails its checksum
+	if (got < sizeof(NSBundleHeader) || !loadbundle(t, data, got)) {
+		free(data);
+		errno = EINVAL;
+		return -1;
+	}
+	return t->nscripts-n;
+}
+
+static int isscript(const struct dirent *ent) {
+	return endswith((char *)ent->d_name, ".bns") || endswith((char *)ent->d_name, ".nsb");
+}
+
+/* Load the scripts and bundles in scripts/ into a new table, in name order, which is the order their routes match in */
+ScriptTable *TigerLoadScripts() {
+	char path[PATH_MAX];
+	struct dirent **list;
+	ScriptTable *t;
+	int nfiles;
+
+	if (!(t = calloc(1, sizeof(ScriptTable)))) {
+		perror("calloc()");
+		exit(1);
+	}
+
+	snprintf(path, sizeof path, "%sscripts", rootpath);
+	if ((nfiles = scandir(path, &list, isscript, alphasort)) < 0) return t;
+
+	for (int i=0; i<nfiles; i++) {
+		char *name = list[i]->d_name;
+		struct stat st;
+		char *buffer;
+		int fd, n;
+
+		snprintf(path, sizeof path, "%sscripts/%s", rootpath, name);
+
+		/* Bundles from netc -b are read whole and used in place */
+		if (endswith(name, ".nsb")) {
+			if ((n = readbundle(t, path)) >= 0) printf("Loaded %d scripts from %s\n", n, name);
+			else if (errno == EINVAL) printf("%s: not a bundle\n", name);
+			else perror(path);
+			free(list[i]);
+			continue;
+		}
+
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+			perror(path);
+			if (fd >= 0) close(fd);
+			free(list[i]);
+			continue;
+		}
+		if (!(buffer = malloc(st.st_size+1)) || read(fd, buffer, st.st_size) != st.st_size) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+
+		LoadedScript *loaded = TigerLoadScript(buffer, st.st_size);
+		free(buffer);
+		if (!loaded) {
+			printf("%s: not a script\n", name);
+		} else {
+			if (!(t->scripts = realloc(t->scripts, (t->nscripts+1)*sizeof(LoadedScript)))) {
+				perror("realloc()");
+				exit(1);
+			}
+			t->scripts[t->nscripts++] = *loaded;
+			free(loaded);
+			printf("Loaded script %s\n", name);
+		}
+		free(list[i]);
+	}
+	free(list);
+	fflush(stdout);
+
+	return t;
+}
+
+void TigerFreeScripts(ScriptTable *t) {
+	if (!t) return;
+
+	for (int i=0; i<t->nscripts; i++) {
+		LoadedScript *s = &t->scripts[i];
+		if (s->inbundle) continue;
+		for (int j=0; j<16 && s->paths[j]; j++) free(s->paths[j]);
+		free(s->code);
+		free(s->ops);
+	}
+	for (int i=0; i<t->nbundles; i++) {
+		free(t->bundles[i].data);
+		free(t->bundles[i].ops);
+	}
+
+	TigerRouteFree(t->routes);
+	free(t->scripts);
+	free(t->bundles);
+	free(t);
+}
+
+/* Answer CONN's request with SCRIPT; runs in the worker, there is nothing to wait for */
+void TigerExecScript(LoadedScript *script, Connection *conn) {
+	execops(script, conn);
 }
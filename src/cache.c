@@ -0,0 +1,408 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <limits.h>
+#include "server.h"
+
+#define CACHE_BUCKETS 4096
+#define CACHE_VALID 1 //Seconds before a cached file is checked against the disk again
+#define SENDFILE_MIN (1024*1024) //Files at least this big are kept open and sent with sendfile()
+#define MAX_FD_ENTRIES 1024
+#define COMPRESS_MIN 256 //Smaller files gain nothing from compression
+
+extern char rootpath[];
+extern bool disable_cache;
+extern const char *encodingexts[];
+
+long cache_budget = 64*1024*1024;
+bool cache_watched = false; //public/ is watched for changes, entries don't need checking against the disk
+
+static CacheEntry *buckets[CACHE_BUCKETS];
+static CacheEntry *hand; //CLOCK hand, entries form a circular list
+static long cache_used;
+static int cache_fds;
+static unsigned long cache_generation; //Bumped by every invalidation
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hashpath(const char *s) {
+	unsigned h = 2166136261u;
+	while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % CACHE_BUCKETS;
+}
+
+static time_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static void freeentry(CacheEntry *e) {
+	for (int i=0; i<ENC_COUNT; i++) TigerCacheRelease(e->variants[i]);
+	if (e->fd >= 0) close(e->fd);
+	if (e->heap) free(e->data);
+	free(e->path);
+	free(e);
+}
+
+/* Memory an entry takes from the budget, variants included */
+static long charged(CacheEntry *e) {
+	long n = e->data ? e->len : 0;
+	for (int i=0; i<ENC_COUNT; i++) {
+		if (e->variants[i]) n += e->variants[i]->len;
+	}
+	return n;
+}
+
+/* Must hold cache_lock; the entry is freed once its last reference is dropped */
+static void unlinkentry(CacheEntry *e) {
+	CacheEntry **p = &buckets[hashpath(e->path)];
+	while (*p != e) p = &(*p)->hnext;
+	*p = e->hnext;
+
+	if (e->cnext == e) {
+		hand = NULL;
+	} else {
+		e->cprev->cnext = e->cnext;
+		e->cnext->cprev = e->cprev;
+		if (hand == e) hand = e->cnext;
+	}
+
+	cache_used -= charged(e);
+	if (!e->data) cache_fds--;
+	e->cached = false;
+	TigerCacheRelease(e);
+}
+
+/* Must hold cache_lock; second-chance eviction until E fits in the budget */
+static void makeroom(CacheEntry *e) {
+	while (hand && (e->data ? cache_used+e->len > cache_budget : cache_fds >= MAX_FD_ENTRIES)) {
+		if (hand->referenced) {
+			hand->referenced = false;
+			hand = hand->cnext;
+		} else {
+			unlinkentry(hand);
+		}
+	}
+}
+
+static CacheEntry *lookup(const char *path) {
+	for (CacheEntry *e = buckets[hashpath(path)]; e; e = e->hnext) {
+		if (!strcmp(e->path, path)) return e;
+	}
+	return NULL;
+}
+
+/*
+ Read up to *LEN bytes of FD into memory; *LEN is set to what was read. Files aren't mapped: one truncated or
+ rewritten in place would raise SIGBUS in whichever thread touched the missing pages, and that kills the server
+*/
+static char *readall(int fd, long *len) {
+	char *data = malloc(*len);
+	long got = 0;
+
+	if (!data) {
+		perror("malloc()");
+		exit(1);
+	}
+	while (got < *len) {
+		ssize_t n = pread(fd, data+got, *len-got, got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			free(data);
+			return NULL;
+		}
+		if (!n) break;
+		got += n;
+	}
+	*len = got;
+	return data;
+}
+
+static CacheEntry *loadentry(const char *path) {
+	char fullpath[PATH_MAX];
+	struct stat st;
+	CacheEntry *e;
+	int fd;
+
+	snprintf(fullpath, sizeof fullpath, "%s/public%s", rootpath, path);
+
+	if ((fd = open(fullpath, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if (!(e = calloc(1, sizeof(CacheEntry))) || !(e->path = strdup(path))) {
+		perror("malloc()");
+		exit(1);
+	}
+
+	e->len = st.st_size;
+	e->mtime = st.st_mtime;
+	e->ino = st.st_ino;
+	e->validated = now();
+	e->refs = 1;
+	e->fd = -1;
+
+	/* Keep large files open instead of reading them; sendfile() only comes up short if one shrinks */
+	if (e->len >= SENDFILE_MIN) {
+		TigerBuildHeader(e);
+		e->fd = fd;
+		return e;
+	}
+
+	/* A file that shrank while being read is served as read, and reloaded once its size no longer matches */
+	if (!e->len) {
+		e->data = "";
+	} else if ((e->data = readall(fd, &e->len))) {
+		e->heap = true;
+	} else {
+		close(fd);
+		freeentry(e);
+		errno = EIO;
+		return NULL;
+	}
+
+	TigerBuildHeader(e);
+	close(fd);
+	return e;
+}
+
+/* Checks an entry against the file on disk at most once every CACHE_VALID seconds */
+static bool isfresh(CacheEntry *e) {
+	char fullpath[PATH_MAX];
+	struct stat st;
+	time_t t = now();
+
+	if (__atomic_load_n(&cache_watched, __ATOMIC_RELAXED) || t - e->validated < CACHE_VALID) return true;
+
+	snprintf(fullpath, sizeof fullpath, "%s/public%s", rootpath, e->path);
+	if (stat(fullpath, &st) || st.st_mtime != e->mtime || st.st_ino != e->ino || st.st_size != e->len) return false;
+
+	e->validated = t;
+	return true;
+}
+
+/* Returns a referenced entry for PATH (relative to public/), loading it on a miss; sets *HIT accordingly */
+CacheEntry *TigerCacheGet(const char *path, bool *hit) {
+	CacheEntry *e;
+	unsigned long generation = 0;
+
+	*hit = false;
+
+	if (!disable_cache) {
+		pthread_mutex_lock(&cache_lock);
+		generation = cache_generation;
+		if ((e = lookup(path))) {
+			if (isfresh(e)) {
+				e->referenced = true;
+				__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&cache_lock);
+				*hit = true;
+				return e;
+			}
+			unlinkentry(e);
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	if (!(e = loadentry(path))) return NULL;
+
+	/* Files larger than the whole budget are served once and dropped */
+	if (disable_cache || (e->data && e->len > cache_budget)) return e;
+
+	pthread_mutex_lock(&cache_lock);
+
+	/* What was read may already be out of date, and nothing would check it again */
+	if (generation != cache_generation) {
+		pthread_mutex_unlock(&cache_lock);
+		return e;
+	}
+
+	/* Another worker may have loaded it in the meantime */
+	CacheEntry *other = lookup(path);
+	if (other) {
+		__atomic_add_fetch(&other->refs, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&cache_lock);
+		TigerCacheRelease(e);
+		*hit = true;
+		return other;
+	}
+
+	makeroom(e);
+
+	unsigned h = hashpath(path);
+	e->hnext = buckets[h];
+	buckets[h] = e;
+
+	if (hand) {
+		e->cnext = hand;
+		e->cprev = hand->cprev;
+		hand->cprev->cnext = e;
+		hand->cprev = e;
+	} else {
+		hand = e->cnext = e->cprev = e;
+	}
+
+	e->cached = true;
+	e->refs++; //The cache holds its own reference, nobody else can see the entry yet
+	cache_used += charged(e);
+	if (!e->data) cache_fds++;
+
+	pthread_mutex_unlock(&cache_lock);
+	return e;
+}
+
+/*
+ Drop the entry for PATH, or with TREE every entry under the directory PATH ("" for all of them).
+ A changed precompressed sibling drops the file it belongs to, whose variants came from it.
+*/
+void TigerCacheInvalidate(const char *path, bool tree) {
+	int len = strlen(path);
+
+	pthread_mutex_lock(&cache_lock);
+	cache_generation++;
+
+	if (tree) {
+		for (int i=0; i<CACHE_BUCKETS; i++) {
+			for (CacheEntry *e = buckets[i], *next; e; e = next) {
+				next = e->hnext;
+				if (!strncmp(e->path, path, len) && e->path[len] == '/') unlinkentry(e);
+			}
+		}
+	} else {
+		CacheEntry *e = lookup(path);
+		if (e) unlinkentry(e);
+
+		for (int enc=ENC_NONE+1; enc<ENC_COUNT; enc++) {
+			int extlen = strlen(encodingexts[enc]);
+			char base[PATH_MAX];
+			if (len <= extlen || len-extlen >= sizeof base || strcmp(path+len-extlen, encodingexts[enc])) continue;
+			snprintf(base, sizeof base, "%.*s", len-extlen, path);
+			if ((e = lookup(base))) unlinkentry(e);
+		}
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void TigerCacheRelease(CacheEntry *e) {
+	if (e && !__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL)) freeentry(e);
+}
+
+/* Build the ENC variant of E from a precompressed sibling in public/, or by compressing E itself */
+static CacheEntry *makevariant(CacheEntry *e, int enc) {
+	char fullpath[PATH_MAX];
+	struct stat st;
+	char *data = NULL;
+	long len = 0;
+	int fd;
+
+	/* Siblings older than the file they belong to are stale and ignored */
+	snprintf(fullpath, sizeof fullpath, "%s/public%s%s", rootpath, e->path, encodingexts[enc]);
+	if ((fd = open(fullpath, O_RDONLY | O_CLOEXEC)) >= 0) {
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_mtime >= e->mtime && st.st_size && st.st_size < SENDFILE_MIN) {
+			len = st.st_size;
+			if ((data = readall(fd, &len)) && !len) {
+				free(data);
+				data = NULL;
+			}
+		}
+		close(fd);
+	}
+
+	/* Otherwise compress it once; only worth keeping if it saves at least a tenth */
+	if (!data && e->data && e->len >= COMPRESS_MIN && TigerCompressible(TigerMimeType(e->path))) {
+		if ((data = TigerCompress(enc, e->data, e->len, &len)) && len > e->len-e->len/10) {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	if (!data) return NULL;
+
+	CacheEntry *v = calloc(1, sizeof(CacheEntry));
+	if (!v || !(v->path = strdup(e->path))) {
+		perror("malloc()");
+		exit(1);
+	}
+
+	v->data = data;
+	v->len = len;
+	v->heap = true;
+	v->fd = -1;
+	v->encoding = enc;
+	v->mtime = e->mtime;
+	v->ino = e->ino;
+	v->refs = 1;
+
+	TigerBuildHeader(v);
+	return v;
+}
+
+/*
+ Swap E for its most preferred variant among the ACCEPTED encodings (a bitmask), if it has one.
+ Variants are looked for once per entry, so the compression cost is paid once per file version.
+*/
+CacheEntry *TigerCacheVariant(CacheEntry *e, int accepted) {
+	for (int enc=ENC_NONE+1; enc<ENC_COUNT; enc++) {
+		if (!(accepted & 1<<enc)) continue;
+
+		CacheEntry *v = __atomic_load_n(&e->variants[enc], __ATOMIC_ACQUIRE);
+		if (!v && !(__atomic_load_n(&e->tried, __ATOMIC_ACQUIRE) & 1<<enc)) {
+			CacheEntry *made = makevariant(e, enc);
+
+			pthread_mutex_lock(&cache_lock);
+			if (made && !e->variants[enc]) {
+				if (e->cached) {
+					makeroom(made);
+					//Making room may have evicted E itself
+					if (e->cached) cache_used += made->len;
+				}
+				__atomic_store_n(&e->variants[enc], made, __ATOMIC_RELEASE);
+				made = NULL;
+			}
+			__atomic_or_fetch(&e->tried, 1<<enc, __ATOMIC_RELEASE);
+			v = e->variants[enc];
+			pthread_mutex_unlock(&cache_lock);
+
+			//Another worker got there first
+			TigerCacheRelease(made);
+		}
+
+		if (v) {
+			__atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+			TigerCacheRelease(e);
+			return v;
+		}
+	}
+
+	return e;
+}
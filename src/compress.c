@@ -0,0 +1,160 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Content negotiation and compression for the cache's encoded variants */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <zlib.h>
+#ifdef TIGER_BROTLI
+#include <brotli/encode.h>
+#endif
+#include "server.h"
+
+#define GZIP_LEVEL 9
+#define BROTLI_QUALITY 9 //11 is several times slower and runs on a worker thread
+
+const char *encodings[ENC_COUNT] = {
+	[ENC_NONE]="identity",
+	[ENC_BR]="br",
+	[ENC_GZIP]="gzip",
+};
+
+/* Precompressed siblings in public/ */
+const char *encodingexts[ENC_COUNT] = {
+	[ENC_NONE]="",
+	[ENC_BR]=".br",
+	[ENC_GZIP]=".gz",
+};
+
+static const char *compressible[] = {
+	"application/javascript",
+	"application/json",
+	"application/xml",
+	"application/wasm",
+	"image/svg+xml",
+	"image/x-icon",
+};
+
+/* Is TYPE worth compressing? Everything textual is, media formats are compressed already */
+bool TigerCompressible(const char *type) {
+	if (!strncmp(type, "text/", 5)) return true;
+	for (int i=0; i<sizeof(compressible)/sizeof(compressible[0]); i++) {
+		if (!strcmp(type, compressible[i])) return true;
+	}
+	return false;
+}
+
+/* Bitmask of the encodings Accept-Encoding allows; codings with q=0 are refused */
+int TigerAcceptEncoding(RequestData *req, const char *buf) {
+	Slice *v = TigerHeader(req, HDR_ACCEPT_ENCODING);
+	int mask = 0;
+
+	if (!v) return 0;
+
+	const char *p = buf+v->off;
+	const char *end = p+v->len;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+		const char *t = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+		int tlen = p-t;
+
+		/* Only q=0, q=0.0... turns a coding off */
+		bool refused = false;
+		while (p < end && *p != ',') {
+			if (*p == 'q' && p+1 < end && p[1] == '=') {
+				const char *q = p+2;
+				refused = q < end && *q == '0';
+				for (q++; refused && q < end && *q != ',' && *q != ' ' && *q != ';'; q++) {
+					if (*q != '.' && *q != '0') refused = false;
+				}
+			}
+			p++;
+		}
+		if (refused) continue;
+
+		if (tlen == 2 && !strncasecmp(t, "br", 2)) mask |= 1<<ENC_BR;
+		else if ((tlen == 4 && !strncasecmp(t, "gzip", 4)) || (tlen == 6 && !strncasecmp(t, "x-gzip", 6))) mask |= 1<<ENC_GZIP;
+	}
+
+	return mask;
+}
+
+static char *gzip(const char *data, long len, long *outlen) {
+	z_stream zs = {0};
+	char *out;
+
+	if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+	long cap = deflateBound(&zs, len);
+	if (!(out = malloc(cap))) {
+		perror("malloc()");
+		exit(1);
+	}
+
+	zs.next_in = (unsigned char *)data;
+	zs.avail_in = len;
+	zs.next_out = (unsigned char *)out;
+	zs.avail_out = cap;
+
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+
+	*outlen = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+#ifdef TIGER_BROTLI
+static char *brotli(const char *data, long len, long *outlen) {
+	size_t cap = BrotliEncoderMaxCompressedSize(len);
+	char *out;
+
+	if (!cap || !(out = malloc(cap))) return NULL;
+
+	if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, (const uint8_t *)data, &cap, (uint8_t *)out)) {
+		free(out);
+		return NULL;
+	}
+
+	*outlen = cap;
+	return out;
+}
+#endif
+
+/* Returns a malloc()ed copy of DATA compressed with ENC, or NULL if ENC isn't available */
+char *TigerCompress(int enc, const char *data, long len, long *outlen) {
+	switch (enc) {
+		case ENC_GZIP:
+			return gzip(data, len, outlen);
+#ifdef TIGER_BROTLI
+		case ENC_BR:
+			return brotli(data, len, outlen);
+#endif
+		default:
+			return NULL;
+	}
+}
@@ -1,6 +1,6 @@
 #include "daemon.h"
 
-extern int create_daemon;
+extern bool create_daemon;
 
 //first half of daemonization
 void daemon_start() {
@@ -47,11 +47,33 @@ void daemon_init() {
 	//we are now a daemon!
 	
 	//write pidfile '/run/tiger/pid'
+	daemon_pidfile(getpid());
+}
+
+void daemon_pidfile(int pid) {
 	FILE *fp = fopen("/run/tiger/pid", "w");
-	fprintf(fp, "%d\n", getpid());
+	if (!fp) return;
+	fprintf(fp, "%d\n", pid);
 	fclose(fp);
 }
 
+//ask the daemon to hand over to a new copy of itself, see upgrade.c; false if there is none
+bool daemon_restart() {
+	FILE *fp = fopen("/run/tiger/pid", "r");
+	int pid;
+	
+	if (!fp) return false;
+	
+	if (fscanf(fp, "%d", &pid) != 1 || kill(pid, SIGUSR2)) {
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	
+	printf("Restarting Daemon (PID %d)...\n", pid);
+	return true;
+}
+
 void daemon_stop() {
 	printf("Stopping Daemon...\n");
 	FILE *fp = fopen("/run/tiger/pid", "r");
@@ -9,3 +9,5 @@
 void daemon_start();
 void daemon_init();
 void daemon_stop();
+void daemon_pidfile(int pid);
+bool daemon_restart();
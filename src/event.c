@@ -0,0 +1,628 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <netinet/ip.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include "server.h"
+
+#define MAX_EVENTS 256
+#define SPAWN_POLL 10 //Milliseconds between checks on children that closed stdout but have not exited yet
+
+extern uint32_t ip_whitelist;
+extern bool draining;
+
+int idle_timeout = 5;
+int max_requests = 100;
+
+static time_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static int setnonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void resetout(Connection *conn);
+
+static void touchconn(Connection *conn) {
+	Worker *worker = conn->worker;
+
+	conn->lastactive = worker->now;
+	if (worker->idletail == conn) return;
+
+	/* Unlink */
+	if (conn->idleprev) conn->idleprev->idlenext = conn->idlenext;
+	else if (worker->idlehead == conn) worker->idlehead = conn->idlenext;
+	if (conn->idlenext) conn->idlenext->idleprev = conn->idleprev;
+
+	/* Append */
+	conn->idleprev = worker->idletail;
+	conn->idlenext = NULL;
+	if (worker->idletail) worker->idletail->idlenext = conn;
+	else worker->idlehead = conn;
+	worker->idletail = conn;
+}
+
+static Connection *newconn(Worker *worker, int sock, struct sockaddr_in *addr) {
+	Connection *conn = worker->freeconns;
+
+	if (conn) {
+		worker->freeconns = conn->next;
+	} else if (!(conn = calloc(1, sizeof(Connection)))) {
+		perror("calloc()");
+		exit(1);
+	}
+
+	conn->sock = sock;
+	conn->state = CONN_READING;
+	conn->addr = *addr;
+	conn->reqlen = 0;
+	conn->reslen = 0;
+	conn->nout = conn->outhead = 0;
+	conn->outoff = 0;
+	conn->nrequests = 0;
+	conn->keepalive = true;
+	conn->headonly = false;
+	conn->eof = false;
+	conn->unread = false;
+	conn->upstream = NULL;
+	conn->waitlen = 0;
+	conn->parsens = conn->phpstart = conn->sendstart = 0;
+	conn->accepted = worker->stats ? TigerStatsClock() : 0;
+	TigerResetRequest(&conn->req);
+	conn->next = NULL;
+	conn->idleprev = conn->idlenext = NULL;
+	conn->worker = worker;
+	touchconn(conn);
+	__atomic_add_fetch(&worker->nconns, 1, __ATOMIC_RELAXED);
+	TigerStatsAccept(worker);
+	return conn;
+}
+
+static void closeconn(Connection *conn) {
+	Worker *worker = conn->worker;
+
+	/* close() only leaves the epoll set once no process has the socket open, and a child another worker is
+	   starting has a copy of every descriptor until its exec() closes them */
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	close(conn->sock);
+	conn->state = CONN_CLOSING;
+	resetout(conn);
+
+	TigerConnDetach(conn);
+
+	if (conn->idleprev) conn->idleprev->idlenext = conn->idlenext;
+	else worker->idlehead = conn->idlenext;
+	if (conn->idlenext) conn->idlenext->idleprev = conn->idleprev;
+	else worker->idletail = conn->idleprev;
+
+	conn->next = worker->freeconns;
+	worker->freeconns = conn;
+	__atomic_sub_fetch(&worker->nconns, 1, __ATOMIC_RELAXED);
+}
+
+void TigerConnWrite(Connection *conn, const char *data, int len) {
+	if (len <= 0) return;
+
+	if (conn->reslen+len > conn->rescap) {
+		int cap = max(conn->rescap*2, conn->reslen+len);
+		char *buf = realloc(conn->resbuff, cap);
+		if (!buf) {
+			perror("realloc()");
+			exit(1);
+		}
+		conn->resbuff = buf;
+		conn->rescap = cap;
+	}
+
+	/* Grow the last segment if it ends where the new bytes go */
+	OutSegment *last = conn->nout ? &conn->out[conn->nout-1] : NULL;
+	if (last && !last->entry && last->off+last->len == conn->reslen) {
+		last->len += len;
+	} else {
+		conn->out[conn->nout++] = (OutSegment){NULL, NULL, conn->reslen, len};
+	}
+
+	memcpy(conn->resbuff+conn->reslen, data, len);
+	conn->reslen += len;
+}
+
+void TigerConnBody(Connection *conn, const char *data, int len) {
+	if (conn->headonly || len <= 0) return;
+	conn->bodylen += len;
+	TigerConnWrite(conn, data, len);
+}
+
+static void queueentry(Connection *conn, CacheEntry *entry, const char *data, long off, long len) {
+	/* The last slot is kept for the connection's own buffer */
+	if (conn->nout >= MAX_SEGMENTS-1 && data) {
+		TigerConnWrite(conn, data+off, len);
+		return;
+	}
+
+	__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+	conn->out[conn->nout++] = (OutSegment){entry, data, off, len};
+}
+
+/* Queue LEN bytes of ENTRY without copying them; takes a reference on ENTRY until they are sent */
+void TigerConnBodyEntry(Connection *conn, CacheEntry *entry, long off, long len) {
+	if (conn->headonly || len <= 0) return;
+	conn->bodylen += len;
+	queueentry(conn, entry, entry->data, off, len);
+}
+
+/* Queue the precomputed 200 header of ENTRY */
+void TigerConnHeaderEntry(Connection *conn, CacheEntry *entry) {
+	static const char keepalive[] = "Connection: keep-alive\r\n\r\n";
+	static const char close[] = "Connection: close\r\n\r\n";
+
+	conn->status = 200;
+	queueentry(conn, entry, entry->header, 0, entry->headerlen);
+	if (conn->keepalive) TigerConnWrite(conn, keepalive, sizeof(keepalive)-1);
+	else TigerConnWrite(conn, close, sizeof(close)-1);
+}
+
+/* Drop everything still queued */
+static void resetout(Connection *conn) {
+	for (int i=conn->outhead; i<conn->nout; i++) {
+		TigerCacheRelease(conn->out[i].entry);
+	}
+	conn->nout = conn->outhead = 0;
+	conn->outoff = 0;
+	conn->reslen = 0;
+}
+
+/* Retire the segments covered by W written bytes */
+static void advanceout(Connection *conn, long w) {
+	while (w > 0) {
+		OutSegment *seg = &conn->out[conn->outhead];
+		long rem = seg->len-conn->outoff;
+
+		if (w < rem) {
+			conn->outoff += w;
+			return;
+		}
+
+		w -= rem;
+		TigerCacheRelease(seg->entry);
+		seg->entry = NULL;
+		conn->outhead++;
+		conn->outoff = 0;
+	}
+}
+
+#define ISFILESEG(seg) ((seg)->entry && !(seg)->data)
+
+//Returns true when the whole response has been written
+static bool flushconn(Connection *conn) {
+	struct iovec iov[MAX_SEGMENTS];
+	ssize_t w;
+
+	while (conn->outhead < conn->nout) {
+		OutSegment *seg = &conn->out[conn->outhead];
+
+		if (ISFILESEG(seg)) {
+			/* Large files go from the page cache to the socket without entering user space */
+			off_t off = seg->off+conn->outoff;
+			w = sendfile(conn->sock, seg->entry->fd, &off, seg->len-conn->outoff);
+
+			if (w == 0) {
+				//File shrank under us, the response can't be completed
+				conn->keepalive = false;
+				break;
+			}
+		} else {
+			int n = 0;
+			bool more = false;
+
+			for (int i=conn->outhead; i<conn->nout; i++, n++) {
+				seg = &conn->out[i];
+				if (ISFILESEG(seg)) {
+					more = true;
+					break;
+				}
+
+				long skip = (i == conn->outhead) ? conn->outoff : 0;
+				const char *base = seg->data ? seg->data+seg->off : conn->resbuff+seg->off;
+
+				iov[n].iov_base = (char *)base+skip;
+				iov[n].iov_len = seg->len-skip;
+			}
+
+			/* MSG_MORE holds back a partial frame so the headers share a packet with the file data */
+			struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+			w = sendmsg(conn->sock, &msg, more ? MSG_MORE : 0);
+		}
+
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+			conn->keepalive = false;
+			break;
+		}
+
+		advanceout(conn, w);
+	}
+
+	resetout(conn);
+	if (conn->sendstart) {
+		TigerStatsTime(conn->worker, STAGE_SEND, TigerStatsClock()-conn->sendstart);
+		conn->sendstart = 0;
+	}
+	return true;
+}
+
+//Read everything available; returns false if the connection broke
+static bool readconn(Connection *conn) {
+	conn->unread = true;
+	while (conn->reqlen < BUFSIZ) {
+		int n = read(conn->sock, conn->reqbuff+conn->reqlen, BUFSIZ-conn->reqlen);
+		if (n == 0) {
+			conn->eof = true;
+			conn->unread = false;
+			break;
+		}
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				conn->unread = false;
+				break;
+			}
+			return false;
+		}
+		conn->reqlen += n;
+	}
+	conn->reqbuff[conn->reqlen] = 0;
+	return true;
+}
+
+/* Drop the LEN bytes of the request just answered */
+static void consumereq(Connection *conn, int len) {
+	memmove(conn->reqbuff, conn->reqbuff+len, conn->reqlen-len);
+	conn->reqlen -= len;
+	conn->reqbuff[conn->reqlen] = 0;
+	TigerResetRequest(&conn->req);
+}
+
+/* The response to the request at the start of the buffer is complete, apart from sending it */
+static void answered(Connection *conn, long now) {
+	TigerLogRequest(conn);
+	TigerStatsRequest(conn);
+	if (now && !conn->sendstart) conn->sendstart = now;
+}
+
+/* Handle every complete request in the buffer; responses to pipelined requests are queued in order */
+static void serveconn(Connection *conn) {
+	bool timed = conn->worker->stats;
+
+	while (conn->state == CONN_READING) {
+		int len = 0;
+
+		//Edge-triggered: what stayed in the socket when the buffer filled up raises no new event
+		if (conn->unread && conn->reqlen < BUFSIZ && !readconn(conn)) {
+			closeconn(conn);
+			return;
+		}
+
+		long start = timed ? TigerStatsClock() : 0;
+		int r = TigerParseRequest(&conn->req, conn->reqbuff, conn->reqlen);
+		long parsed = timed ? TigerStatsClock() : 0;
+
+		conn->parsens += parsed-start;
+
+		if (r == PARSE_AGAIN && conn->reqlen == BUFSIZ) {
+			conn->req.error = 413;
+			r = PARSE_ERROR;
+		}
+
+		if (r == PARSE_AGAIN && conn->eof) {
+			//Client hung up in the middle of a request
+			conn->keepalive = false;
+		}
+
+		if (r != PARSE_AGAIN) {
+			len = (r == PARSE_DONE) ? conn->req.length : conn->reqlen;
+			conn->nrequests++;
+			conn->keepalive = false;
+			conn->headonly = false;
+			conn->status = 0;
+			conn->bodylen = 0;
+			if (timed) {
+				if (conn->nrequests == 1) TigerStatsTime(conn->worker, STAGE_ACCEPT, parsed-conn->accepted);
+				TigerStatsTime(conn->worker, STAGE_PARSE, conn->parsens);
+				conn->parsens = 0;
+			}
+			TigerHandleRequest(conn);
+			long handled = timed ? TigerStatsClock() : 0;
+			if (timed) TigerStatsTime(conn->worker, STAGE_LOAD, handled-parsed);
+			if (r == PARSE_ERROR) conn->keepalive = false;
+
+			/* A request handed to an upstream stays in the buffer, with the ones behind it, until it is answered */
+			if (conn->state == CONN_WAITING) {
+				conn->waitlen = len;
+				if (conn->upstream && *(int *)conn->upstream != SOURCE_PAGE) {
+					TigerStatsPHP(conn->worker);
+					conn->phpstart = handled;
+				}
+				flushconn(conn);
+				return;
+			}
+			answered(conn, handled);
+			consumereq(conn, len);
+
+			/* Keep pipelining until the client stops or too much output is waiting */
+			if (conn->keepalive && conn->reslen < MAX_PENDING && conn->nout < MAX_SEGMENTS/2) continue;
+		}
+
+		if (!flushconn(conn)) {
+			conn->state = CONN_WRITING;
+			return;
+		}
+
+		if (!conn->keepalive) {
+			closeconn(conn);
+			return;
+		}
+
+		if (!len) return;
+	}
+}
+
+static void onreadable(Connection *conn) {
+	touchconn(conn);
+
+	if (!readconn(conn)) {
+		closeconn(conn);
+		return;
+	}
+
+	if (conn->state != CONN_WAITING) serveconn(conn);
+}
+
+static void onwritable(Connection *conn) {
+	if (conn->state == CONN_WAITING) {
+		if (!flushconn(conn)) return;
+		switch (*(int *)conn->upstream) {
+			case SOURCE_FASTCGI: TigerFcgiResume(conn->upstream); break;
+			case SOURCE_PIPE: TigerSpawnResume(conn->upstream); break;
+		}
+		return;
+	}
+
+	if (conn->state != CONN_WRITING) return;
+	touchconn(conn);
+
+	if (!flushconn(conn)) return;
+
+	if (!conn->keepalive) {
+		closeconn(conn);
+		return;
+	}
+
+	/* The buffer may have filled up while we were writing */
+	conn->state = CONN_READING;
+	onreadable(conn);
+}
+
+/* Idle list is ordered by activity, so only expired connections at the head are visited */
+static void closeidle(Worker *worker) {
+	while (worker->idlehead && worker->now - worker->idlehead->lastactive >= idle_timeout) {
+		//Slow scripts aren't the client's fault
+		if (worker->idlehead->state == CONN_WAITING) touchconn(worker->idlehead);
+		else closeconn(worker->idlehead);
+	}
+}
+
+/* Send what an upstream has produced so far; false if some of it has to wait for the client */
+bool TigerConnFlush(Connection *conn) {
+	touchconn(conn);
+	return flushconn(conn);
+}
+
+/* Stop waiting for CONN's upstream, which drops its output or, if it fills the page cache, carries on alone */
+void TigerConnDetach(Connection *conn) {
+	if (!conn->upstream) return;
+
+	switch (*(int *)conn->upstream) {
+		case SOURCE_FASTCGI: TigerFcgiDetach(conn->upstream); break;
+		case SOURCE_PIPE: TigerSpawnDetach(conn->upstream); break;
+		case SOURCE_PAGE: TigerPageDetach(conn->upstream); break;
+	}
+	conn->upstream = NULL;
+}
+
+/* The upstream response CONN was waiting for is complete, go on with the requests behind it */
+void TigerConnFinish(Connection *conn) {
+	long now = conn->worker->stats ? TigerStatsClock() : 0;
+
+	conn->state = CONN_READING;
+	if (conn->phpstart) {
+		TigerStatsTime(conn->worker, STAGE_PHP, now-conn->phpstart);
+		conn->phpstart = 0;
+	}
+	answered(conn, now);
+	consumereq(conn, conn->waitlen);
+	conn->waitlen = 0;
+
+	if (!flushconn(conn)) {
+		conn->state = CONN_WRITING;
+		return;
+	}
+
+	if (!conn->keepalive) {
+		closeconn(conn);
+		return;
+	}
+
+	//Reading again also picks up anything left behind when the buffer was full
+	onreadable(conn);
+}
+
+static void acceptconns(Worker *worker) {
+	struct sockaddr_in caddr;
+	socklen_t caddrl;
+	int csock;
+
+	while (true) {
+		caddrl = sizeof(caddr);
+		csock = accept4(worker->serversock, (struct sockaddr *)&caddr, &caddrl, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (csock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept()");
+			return;
+		}
+
+		if (ip_whitelist & caddr.sin_addr.s_addr) {
+			if (ntohl(caddr.sin_addr.s_addr) != ip_whitelist) {
+				close(csock);
+				continue;
+			}
+		}
+
+		Connection *conn = newconn(worker, csock, &caddr);
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.ptr = conn
+		};
+
+		if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, csock, &ev)) {
+			perror("epoll_ctl()");
+			closeconn(conn);
+		}
+	}
+}
+
+/* Leave the listener to the process that took over, and close the keep-alive connections between requests; new ones still get their first */
+static void stopaccepting(Worker *worker) {
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, worker->serversock, NULL);
+	close(worker->serversock);
+	worker->serversock = -1;
+
+	for (Connection *conn = worker->idlehead, *next; conn; conn = next) {
+		next = conn->idlenext;
+		if (conn->state == CONN_READING && conn->nrequests && !conn->reqlen) closeconn(conn);
+	}
+}
+
+void TigerEventLoop(Worker *worker) {
+	struct epoll_event events[MAX_EVENTS];
+	int epfd = worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	worker->now = now();
+
+	if (epfd < 0) {
+		perror("epoll_create1()");
+		exit(127);
+	}
+
+	if (setnonblock(worker->serversock)) {
+		perror("fcntl()");
+		exit(127);
+	}
+
+	/* The listening socket is the only source registered without a SOURCE_ tag */
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLET,
+		.data.ptr = NULL
+	};
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, worker->serversock, &ev)) {
+		perror("epoll_ctl()");
+		exit(127);
+	}
+
+	/* Other workers hand back requests that waited on the page cache through an eventfd */
+	static int wakesource = SOURCE_WAKE;
+	ev.data.ptr = &wakesource;
+	if ((worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, worker->wakefd, &ev)) {
+		perror("eventfd()");
+		exit(127);
+	}
+
+	while (true) {
+		//Wake up now and then while there are connections to time out or children to reap
+		__atomic_add_fetch(&worker->epoch, 1, __ATOMIC_SEQ_CST);
+		int n = epoll_wait(epfd, events, MAX_EVENTS, worker->spawndone ? SPAWN_POLL : worker->idlehead ? 1000 : -1);
+		__atomic_add_fetch(&worker->epoch, 1, __ATOMIC_SEQ_CST);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait()");
+			exit(127);
+		}
+
+		worker->now = now();
+
+		for (int i=0; i<n; i++) {
+			Connection *conn = events[i].data.ptr;
+
+			if (!conn) {
+				acceptconns(worker);
+				continue;
+			}
+
+			if (conn->source == SOURCE_FASTCGI) {
+				TigerFcgiEvent(events[i].data.ptr, events[i].events);
+				continue;
+			}
+			if (conn->source == SOURCE_PIPE) {
+				TigerSpawnEvent(events[i].data.ptr, events[i].events);
+				continue;
+			}
+			if (conn->source == SOURCE_WAKE) {
+				TigerPageWake(worker);
+				continue;
+			}
+
+			if (conn->state == CONN_CLOSING) continue;
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				closeconn(conn);
+				continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP)) onreadable(conn);
+			if (conn->state == CONN_CLOSING) continue;
+			if (events[i].events & EPOLLOUT) onwritable(conn);
+		}
+
+		TigerFcgiReap(worker);
+		TigerSpawnReap(worker);
+		closeidle(worker);
+
+		if (__atomic_load_n(&draining, __ATOMIC_RELAXED) && worker->serversock >= 0) stopaccepting(worker);
+	}
+}
@@ -0,0 +1,691 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* FastCGI client: PHP runs in long-lived php-fpm or php-cgi -b processes, spoken to from the event loop */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include "server.h"
+
+#define FCGI_VERSION 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_MAX_RECORD (FCGI_HEADER_LEN+FCGI_MAX_CONTENT+255)
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+
+#define FCGI_MAX_MPX 16 //Requests in flight on one connection, if the backend multiplexes at all
+#define FCGI_MAX_IDLE 16 //Idle connections each worker keeps around
+#define CGI_MAX_HEADER 4096
+
+extern char rootpath[];
+
+char *fastcgi_addr = NULL;
+
+typedef struct FcgiRequest {
+	int source; //SOURCE_FASTCGI, must come first
+	int id;
+	Connection *conn; //NULL once the client has gone away
+	struct FcgiUpstream *up;
+	bool started; //Response head already sent to the client
+	bool chunked;
+	bool nobody; //The response can't have a body, whatever the script writes is dropped
+	char *head; //CGI headers received so far
+	int headlen;
+	struct PageFill *fill; //Copy of the response for the page cache
+} FcgiRequest;
+
+typedef struct FcgiUpstream {
+	int source; //Must come first, see TigerEventLoop()
+	int sock;
+	Worker *worker;
+	bool connecting;
+	bool paused; //Not reading until a slow client catches up
+	bool reading;
+	bool broken;
+
+	char *out; //Records waiting to be written
+	int outlen, outoff, outcap;
+	char *in; //Partial record
+	int inlen;
+
+	FcgiRequest *reqs[FCGI_MAX_MPX]; //Indexed by request id - 1
+	int nreqs;
+	int maxreqs;
+
+	struct FcgiUpstream *next, *prev;
+} FcgiUpstream;
+
+static void putrecord(FcgiUpstream *up, int type, int id, const char *data, int len) {
+	int pad = (8 - len%8) % 8;
+	int need = up->outlen+FCGI_HEADER_LEN+len+pad;
+
+	if (need > up->outcap) {
+		int cap = max(up->outcap*2, need);
+		char *out = realloc(up->out, cap);
+		if (!out) {
+			perror("realloc()");
+			exit(1);
+		}
+		up->out = out;
+		up->outcap = cap;
+	}
+
+	unsigned char *h = (unsigned char *)up->out+up->outlen;
+	h[0] = FCGI_VERSION;
+	h[1] = type;
+	h[2] = id >> 8;
+	h[3] = id & 0xff;
+	h[4] = len >> 8;
+	h[5] = len & 0xff;
+	h[6] = pad;
+	h[7] = 0;
+	if (len) memcpy(h+FCGI_HEADER_LEN, data, len);
+	memset(h+FCGI_HEADER_LEN+len, 0, pad);
+	up->outlen = need;
+}
+
+/* Append a name-value pair to BUF, which holds up to FCGI_MAX_CONTENT bytes; pairs that don't fit are dropped */
+static void addparam(char *buf, int *len, const char *name, int nlen, const char *value, int vlen) {
+	unsigned char *p = (unsigned char *)buf+*len;
+
+	if (*len + nlen + vlen + 8 > FCGI_MAX_CONTENT) return;
+
+	if (nlen < 128) *p++ = nlen;
+	else *p++ = (nlen >> 24) | 0x80, *p++ = nlen >> 16, *p++ = nlen >> 8, *p++ = nlen;
+	if (vlen < 128) *p++ = vlen;
+	else *p++ = (vlen >> 24) | 0x80, *p++ = vlen >> 16, *p++ = vlen >> 8, *p++ = vlen;
+
+	memcpy(p, name, nlen);
+	memcpy(p+nlen, value, vlen);
+	*len = (char *)p+nlen+vlen-buf;
+}
+
+static void addstr(char *buf, int *len, const char *name, const char *value) {
+	addparam(buf, len, name, strlen(name), value, strlen(value));
+}
+
+static void addslice(char *buf, int *len, const char *name, const char *base, Slice s) {
+	addparam(buf, len, name, strlen(name), base+s.off, s.len);
+}
+
+/* The CGI/1.1 environment of the request, plus an HTTP_* variable per header */
+static int buildparams(Connection *conn, char *buf) {
+	RequestData *req = &conn->req;
+	const char *b = conn->reqbuff;
+	struct sockaddr_in local;
+	socklen_t locallen = sizeof local;
+	char tmp[PATH_MAX+16];
+	char name[128];
+	int len = 0;
+
+	addstr(buf, &len, "GATEWAY_INTERFACE", "CGI/1.1");
+	addstr(buf, &len, "SERVER_SOFTWARE", "Tiger/"TIGER_VERS);
+	addstr(buf, &len, "REDIRECT_STATUS", "200"); //php-cgi refuses to run without it
+	addslice(buf, &len, "SERVER_PROTOCOL", b, req->protocol);
+	addslice(buf, &len, "REQUEST_METHOD", b, req->rverb);
+	addslice(buf, &len, "REQUEST_URI", b, req->target);
+	addslice(buf, &len, "QUERY_STRING", b, req->query);
+	addstr(buf, &len, "SCRIPT_NAME", req->truepath);
+	addstr(buf, &len, "DOCUMENT_URI", req->truepath);
+
+	snprintf(tmp, sizeof tmp, "%spublic", rootpath);
+	addstr(buf, &len, "DOCUMENT_ROOT", tmp);
+	snprintf(tmp, sizeof tmp, "%spublic%s", rootpath, req->truepath);
+	addstr(buf, &len, "SCRIPT_FILENAME", tmp);
+
+	inet_ntop(AF_INET, &conn->addr.sin_addr, tmp, sizeof tmp);
+	addstr(buf, &len, "REMOTE_ADDR", tmp);
+	snprintf(tmp, sizeof tmp, "%d", ntohs(conn->addr.sin_port));
+	addstr(buf, &len, "REMOTE_PORT", tmp);
+
+	if (!getsockname(conn->sock, (struct sockaddr *)&local, &locallen)) {
+		inet_ntop(AF_INET, &local.sin_addr, tmp, sizeof tmp);
+		addstr(buf, &len, "SERVER_ADDR", tmp);
+		if (!TigerHeader(req, HDR_HOST)) addstr(buf, &len, "SERVER_NAME", tmp);
+		snprintf(tmp, sizeof tmp, "%d", ntohs(local.sin_port));
+		addstr(buf, &len, "SERVER_PORT", tmp);
+	}
+
+	Slice *host = TigerHeader(req, HDR_HOST);
+	if (host) {
+		const char *colon = memchr(b+host->off, ':', host->len);
+		addparam(buf, &len, "SERVER_NAME", 11, b+host->off, colon ? colon-(b+host->off) : host->len);
+	}
+
+	if (req->contentlen >= 0) {
+		snprintf(tmp, sizeof tmp, "%ld", req->contentlen);
+		addstr(buf, &len, "CONTENT_LENGTH", tmp);
+	}
+	if (TigerHeader(req, HDR_CONTENT_TYPE)) addslice(buf, &len, "CONTENT_TYPE", b, *TigerHeader(req, HDR_CONTENT_TYPE));
+
+	for (int i=0; i<req->nheaders; i++) {
+		Header *h = &req->headers[i];
+		int n = 5;
+
+		/* Content-Type and -Length have their own variables; Proxy would set HTTP_PROXY (httpoxy) */
+		if (h->name.len > sizeof(name)-6 || &h->value == TigerHeader(req, HDR_CONTENT_TYPE) || &h->value == TigerHeader(req, HDR_CONTENT_LENGTH)) continue;
+		if (h->name.len == 5 && !strncasecmp(b+h->name.off, "Proxy", 5)) continue;
+
+		memcpy(name, "HTTP_", 5);
+		for (int j=0; j<h->name.len; j++) {
+			char c = b[h->name.off+j];
+			//Underscores would let one header pose as another
+			if (c == '_') n = 0;
+			if (!n) break;
+			name[n++] = c == '-' ? '_' : (c >= 'a' && c <= 'z') ? c-'a'+'A' : c;
+		}
+		if (n) addparam(buf, &len, name, n, b+h->value.off, h->value.len);
+	}
+
+	return len;
+}
+
+static FcgiUpstream *openupstream(Worker *worker) {
+	struct sockaddr_un un = {.sun_family = AF_UNIX};
+	struct sockaddr_in in = {.sin_family = AF_INET};
+	struct sockaddr *addr;
+	socklen_t addrlen;
+	char host[64];
+	int port, sock;
+
+	/* Either a Unix socket path or an IPv4 host:port */
+	if (strchr(fastcgi_addr, '/')) {
+		snprintf(un.sun_path, sizeof un.sun_path, "%s", fastcgi_addr);
+		addr = (struct sockaddr *)&un;
+		addrlen = sizeof un;
+	} else if (sscanf(fastcgi_addr, "%63[^:]:%d", host, &port) == 2 && inet_pton(AF_INET, host, &in.sin_addr) == 1) {
+		in.sin_port = htons(port);
+		addr = (struct sockaddr *)&in;
+		addrlen = sizeof in;
+	} else {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((sock = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) return NULL;
+
+	bool connecting = false;
+	if (connect(sock, addr, addrlen)) {
+		if (errno != EINPROGRESS) {
+			close(sock);
+			return NULL;
+		}
+		connecting = true;
+	}
+
+	FcgiUpstream *up = calloc(1, sizeof(FcgiUpstream));
+	if (!up || !(up->in = malloc(FCGI_MAX_RECORD))) {
+		perror("malloc()");
+		exit(1);
+	}
+
+	up->source = SOURCE_FASTCGI;
+	up->sock = sock;
+	up->worker = worker;
+	up->connecting = connecting;
+	up->maxreqs = 1;
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.ptr = up
+	};
+	if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, sock, &ev)) {
+		perror("epoll_ctl()");
+		close(sock);
+		free(up->in);
+		free(up);
+		return NULL;
+	}
+
+	/* Ask whether requests may share the connection; backends that don't answer get one at a time */
+	char query[32];
+	int qlen = 0;
+	addparam(query, &qlen, "FCGI_MPXS_CONNS", 15, "", 0);
+	putrecord(up, FCGI_GET_VALUES, 0, query, qlen);
+
+	up->next = worker->fcgipool;
+	if (up->next) up->next->prev = up;
+	worker->fcgipool = up;
+	return up;
+}
+
+/* Takes UP out of the pool; its requests are failed and it is freed by TigerFcgiReap() once the event batch is done */
+static void breakupstream(FcgiUpstream *up) {
+	Worker *worker = up->worker;
+
+	if (up->broken) return;
+	up->broken = true;
+
+	if (up->prev) up->prev->next = up->next;
+	else worker->fcgipool = up->next;
+	if (up->next) up->next->prev = up->prev;
+
+	up->prev = NULL;
+	up->next = worker->fcgidead;
+	worker->fcgidead = up;
+}
+
+static void flushupstream(FcgiUpstream *up) {
+	if (up->connecting || up->broken) return;
+
+	while (up->outoff < up->outlen) {
+		int w = write(up->sock, up->out+up->outoff, up->outlen-up->outoff);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+			breakupstream(up);
+			return;
+		}
+		up->outoff += w;
+	}
+	up->outoff = up->outlen = 0;
+}
+
+static FcgiUpstream *pickupstream(Worker *worker) {
+	for (FcgiUpstream *up = worker->fcgipool; up; up = up->next) {
+		if (up->nreqs < up->maxreqs) return up;
+	}
+	return openupstream(worker);
+}
+
+/* Hand CONN's current request to PHP; the response is streamed back as it is produced, and copied to FILL if set */
+bool TigerFcgiStart(Connection *conn, struct PageFill *fill) {
+	static __thread char params[FCGI_MAX_CONTENT];
+	RequestData *req = &conn->req;
+	FcgiUpstream *up;
+	FcgiRequest *r;
+	int slot;
+
+	if (!(up = pickupstream(conn->worker))) return false;
+
+	for (slot = 0; up->reqs[slot]; slot++);
+
+	if (!(r = calloc(1, sizeof(FcgiRequest)))) {
+		perror("calloc()");
+		exit(1);
+	}
+	r->source = SOURCE_FASTCGI;
+	r->id = slot+1;
+	r->conn = conn;
+	r->up = up;
+	r->fill = fill;
+	up->reqs[slot] = r;
+	up->nreqs++;
+
+	/* Without chunked encoding the end of the body can only be told by closing */
+	r->chunked = req->minor == 1;
+	if (!r->chunked) conn->keepalive = false;
+
+	unsigned char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN};
+	putrecord(up, FCGI_BEGIN_REQUEST, r->id, (char *)begin, sizeof begin);
+	putrecord(up, FCGI_PARAMS, r->id, params, buildparams(conn, params));
+	putrecord(up, FCGI_PARAMS, r->id, NULL, 0);
+	if (req->body.len) putrecord(up, FCGI_STDIN, r->id, conn->reqbuff+req->body.off, req->body.len);
+	putrecord(up, FCGI_STDIN, r->id, NULL, 0);
+
+	conn->upstream = r;
+	conn->state = CONN_WAITING;
+	flushupstream(up);
+	return true;
+}
+
+static void chunk(FcgiRequest *r, const char *data, int len) {
+	char size[16];
+
+	if (!len) return;
+	if (r->fill) TigerPageBody(r->fill, data, len);
+	if (!r->conn || r->nobody) return;
+	if (r->chunked) TigerConnBody(r->conn, size, snprintf(size, sizeof size, "%x\r\n", len));
+	TigerConnBody(r->conn, data, len);
+	if (r->chunked) TigerConnBody(r->conn, "\r\n", 2);
+}
+
+/* Turn the CGI header block into the HTTP response head; returns false if it is malformed */
+static bool sendhead(FcgiRequest *r, int end) {
+	char extra[CGI_MAX_HEADER+64];
+	int extralen = 0;
+	int status = 0;
+	bool location = false;
+	char *p = r->head;
+
+	while (p < r->head+end) {
+		char *nl = memchr(p, '\n', r->head+end-p);
+		char *e = nl ? nl : r->head+end;
+		char *line = p;
+		p = e+1;
+		if (e > line && e[-1] == '\r') e--;
+		if (e == line) continue;
+
+		char *colon = memchr(line, ':', e-line);
+		if (!colon || colon == line) return false;
+		int nlen = colon-line;
+
+		if (nlen == 6 && !strncasecmp(line, "Status", 6)) {
+			status = strtol(colon+1, NULL, 10);
+			if (status < 100 || status > 599) return false;
+			continue;
+		}
+		if (nlen == 8 && !strncasecmp(line, "Location", 8)) location = true;
+
+		/* Tiger frames the body itself */
+		if ((nlen == 14 && !strncasecmp(line, "Content-Length", 14)) ||
+			(nlen == 17 && !strncasecmp(line, "Transfer-Encoding", 17)) ||
+			(nlen == 10 && !strncasecmp(line, "Connection", 10)) ||
+			(nlen == 10 && !strncasecmp(line, "Keep-Alive", 10))) continue;
+
+		extralen += snprintf(extra+extralen, sizeof(extra)-extralen, "%.*s\r\n", (int)(e-line), line);
+	}
+
+	if (!status) status = location ? 302 : 200;
+	if (r->fill) TigerPageHead(r->fill, status, extra);
+
+	/* Neither framed nor followed by a body, which would be taken for the start of the next response */
+	if (status < 200 || status == 204 || status == 304 || (r->conn && r->conn->headonly)) {
+		r->nobody = true;
+		r->chunked = false;
+	}
+	if (r->chunked) snprintf(extra+extralen, sizeof(extra)-extralen, "Transfer-Encoding: chunked\r\n");
+
+	if (r->conn) TigerConnHeader(r->conn, status, -1, extra);
+	r->started = true;
+	return true;
+}
+
+static void onstdout(FcgiRequest *r, const char *data, int len) {
+	Connection *conn = r->conn;
+
+	if ((!conn && !r->fill) || !len) return;
+
+	if (r->started) {
+		chunk(r, data, len);
+	} else {
+		/* Gather the CGI headers, which may span several records */
+		int n = min(len, CGI_MAX_HEADER-r->headlen);
+		if (!r->head && !(r->head = malloc(CGI_MAX_HEADER))) {
+			perror("malloc()");
+			exit(1);
+		}
+		memcpy(r->head+r->headlen, data, n);
+		r->headlen += n;
+
+		int end = -1, body = 0;
+		for (int i=0; i<r->headlen; i++) {
+			if (r->head[i] != '\n') continue;
+			if (i+1 < r->headlen && r->head[i+1] == '\n') { end = i+1; body = i+2; break; }
+			if (i+2 < r->headlen && r->head[i+1] == '\r' && r->head[i+2] == '\n') { end = i+1; body = i+3; break; }
+		}
+
+		if (end < 0) {
+			if (r->headlen < CGI_MAX_HEADER) return;
+			end = -2;
+		}
+
+		if (end == -2 || !sendhead(r, end)) {
+			//Nothing usable came back; the rest of the output is dropped
+			TigerPageEnd(r->fill, false);
+			r->fill = NULL;
+			r->started = true;
+			r->chunked = false;
+			r->conn = NULL;
+			if (!conn) return;
+			TigerErrorHandler(502, conn, rootpath);
+			conn->keepalive = false;
+			conn->upstream = NULL;
+			TigerConnFinish(conn);
+			return;
+		}
+
+		/* Whatever followed the headers, in this record and the ones gathered before */
+		chunk(r, r->head+body, r->headlen-body);
+		chunk(r, data+n, len-n);
+		free(r->head);
+		r->head = NULL;
+	}
+
+	if (conn && !TigerConnFlush(conn) && conn->reslen > MAX_PENDING) r->up->paused = true;
+}
+
+static void endrequest(FcgiRequest *r, bool complete) {
+	Connection *conn = r->conn;
+	FcgiUpstream *up = r->up;
+
+	up->reqs[r->id-1] = NULL;
+	up->nreqs--;
+	up->paused = false; //Whoever was slow, the output behind this is for someone else
+
+	TigerPageEnd(r->fill, complete && r->started);
+
+	if (conn) {
+		conn->upstream = NULL;
+		if (!r->started) {
+			TigerErrorHandler(502, conn, rootpath);
+		} else if (!complete) {
+			//The client can only tell the response was cut short if the connection ends with it
+			conn->keepalive = false;
+		} else if (r->chunked) {
+			TigerConnBody(conn, "0\r\n\r\n", 5);
+		}
+		TigerConnFinish(conn);
+	}
+
+	free(r->head);
+	free(r);
+}
+
+static void onrecord(FcgiUpstream *up, int type, int id, const char *data, int len) {
+	FcgiRequest *r = (id >= 1 && id <= FCGI_MAX_MPX) ? up->reqs[id-1] : NULL;
+
+	switch (type) {
+		case FCGI_STDOUT:
+			if (r) onstdout(r, data, len);
+			break;
+		case FCGI_STDERR:
+			fprintf(stderr, "PHP: %.*s", len, data);
+			break;
+		case FCGI_END_REQUEST:
+			if (r) endrequest(r, true);
+			break;
+		case FCGI_GET_VALUES_RESULT:
+			/* A single pair, FCGI_MPXS_CONNS, whose value is "1" if requests may share the connection */
+			if (len >= 18 && data[0] == 15 && !memcmp(data+2, "FCGI_MPXS_CONNS", 15) && data[1] == 1 && data[17] == '1') {
+				up->maxreqs = FCGI_MAX_MPX;
+			}
+			break;
+	}
+}
+
+static void readupstream(FcgiUpstream *up) {
+	//Finishing a request can lead back here through the client connection
+	if (up->reading) return;
+	up->reading = true;
+
+	while (!up->paused && !up->broken) {
+		int n = read(up->sock, up->in+up->inlen, FCGI_MAX_RECORD-up->inlen);
+		if (n == 0) {
+			breakupstream(up);
+			break;
+		}
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) breakupstream(up);
+			break;
+		}
+		up->inlen += n;
+
+		int pos = 0;
+		while (up->inlen-pos >= FCGI_HEADER_LEN) {
+			unsigned char *h = (unsigned char *)up->in+pos;
+			int len = h[4] << 8 | h[5];
+			int total = FCGI_HEADER_LEN+len+h[6];
+			if (up->inlen-pos < total) break;
+
+			onrecord(up, h[1], h[2] << 8 | h[3], up->in+pos+FCGI_HEADER_LEN, len);
+			pos += total;
+		}
+		memmove(up->in, up->in+pos, up->inlen-pos);
+		up->inlen -= pos;
+	}
+	up->reading = false;
+
+	/* Don't hoard idle connections */
+	if (!up->broken && !up->nreqs) {
+		int idle = 0;
+		for (FcgiUpstream *u = up->worker->fcgipool; u; u = u->next) idle += !u->nreqs;
+		if (idle > FCGI_MAX_IDLE) breakupstream(up);
+	}
+}
+
+void TigerFcgiEvent(void *source, uint32_t events) {
+	FcgiUpstream *up = source;
+	int err = 0;
+	socklen_t errlen = sizeof err;
+
+	if (up->broken) return;
+
+	if (up->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+		if (getsockopt(up->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+			breakupstream(up);
+			return;
+		}
+		up->connecting = false;
+	}
+
+	if (events & EPOLLERR) {
+		breakupstream(up);
+		return;
+	}
+
+	if (events & EPOLLOUT) flushupstream(up);
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) readupstream(up);
+}
+
+/* CONN has caught up with its output, let its upstream produce more */
+void TigerFcgiResume(FcgiRequest *r) {
+	FcgiUpstream *up = r->up;
+
+	if (!up->paused) return;
+	up->paused = false;
+	readupstream(up);
+}
+
+/* The client went away; the request is cancelled and whatever PHP still sends is dropped, unless it is wanted for the page cache */
+void TigerFcgiDetach(FcgiRequest *r) {
+	FcgiUpstream *up = r->up;
+
+	r->conn = NULL;
+	if (up->broken) return;
+
+	if (!r->fill) {
+		putrecord(up, FCGI_ABORT_REQUEST, r->id, NULL, 0);
+		flushupstream(up);
+	}
+
+	//Its output no longer has anywhere to wait
+	if (up->paused) TigerFcgiResume(r);
+}
+
+/* Free the connections broken during the last event batch, failing the requests they carried */
+void TigerFcgiReap(Worker *worker) {
+	FcgiUpstream *up;
+
+	while ((up = worker->fcgidead)) {
+		worker->fcgidead = up->next;
+
+		for (int i=0; i<FCGI_MAX_MPX; i++) {
+			if (up->reqs[i]) endrequest(up->reqs[i], false);
+		}
+
+		//See closeconn() in event.c
+		epoll_ctl(worker->epfd, EPOLL_CTL_DEL, up->sock, NULL);
+		close(up->sock);
+		free(up->in);
+		free(up->out);
+		free(up);
+	}
+}
+
+/* Start php-cgi with CHILDREN processes on a socket in cache/ and send PHP requests there */
+void TigerFcgiSpawn(int children) {
+	static char path[PATH_MAX];
+	char nchildren[16];
+	struct stat st;
+	pid_t pid;
+
+	snprintf(path, sizeof path, "%scache/php-fcgi.sock", rootpath);
+	snprintf(nchildren, sizeof nchildren, "%d", children);
+	unlink(path);
+
+	if ((pid = fork()) < 0) {
+		perror("fork()");
+		exit(1);
+	}
+
+	if (!pid) {
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		//Only stdio is php-cgi's
+		close_range(STDERR_FILENO+1, ~0U, 0);
+		setenv("PHP_FCGI_CHILDREN", nchildren, 1);
+		execlp("php-cgi", "php-cgi", "-b", path, NULL);
+		perror("php-cgi");
+		_exit(127);
+	}
+
+	/* Wait for the socket to show up */
+	for (int i=0; stat(path, &st) || !S_ISSOCK(st.st_mode); i++) {
+		if (i == 500 || waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "Unable to start php-cgi\n");
+			exit(1);
+		}
+		usleep(10000);
+	}
+
+	printf("php-cgi: %d children on %s\n", children, path);
+	fastcgi_addr = path;
+}
@@ -75,10 +75,11 @@ char *ntoken(char *const s, char *d, int t) {
 	if (!tk) {
 		perror("malloc");
 	}
+	char *save;
 	strcpy(tk, s);
-	strtok(tk, d);
+	strtok_r(tk, d, &save);
 	for (int i=0; i<t; i++) {
-		tk = strtok(0, d);
+		tk = strtok_r(0, d, &save);
 	}
 	return tk;
 }
@@ -96,11 +97,12 @@ int count(char *const s, char c, int l) {
 //parse IP address
 uint32_t parse_ip(char *const s) {
 	uint32_t a, b, c, d;
+	char *p;
 	if (count(s, '.', strlen(s))) {
-		a = strtol(s, &s, 0);
-		b = strtol(s+1, &s, 0);
-		c = strtol(s+1, &s, 0);
-		d = strtol(s+1, &s, 0);
+		a = strtol(s, &p, 0);
+		b = strtol(p+1, &p, 0);
+		c = strtol(p+1, &p, 0);
+		d = strtol(p+1, &p, 0);
 		
 		return ((uint8_t)a << 24) +
 		       ((uint8_t)b << 16) +
@@ -110,3 +112,74 @@ uint32_t parse_ip(char *const s) {
 		return strtol(s, NULL, 0);
 	}
 }
+
+//Resolve '.', '..' and repeated slashes in an absolute path in place, never going above '/'
+void normpath(char *path) {
+	char *o = path;
+	char *p = path;
+	
+	while (*p) {
+		while (*p == '/') p++;
+		if (!*p) break;
+		
+		char *e = strchr(p, '/');
+		int len = e ? e-p : strlen(p);
+		
+		if (len == 1 && p[0] == '.') {
+			//skip
+		} else if (len == 2 && p[0] == '.' && p[1] == '.') {
+			while (o > path && *--o != '/');
+		} else {
+			*o++ = '/';
+			memmove(o, p, len);
+			o += len;
+		}
+		p += len;
+	}
+	
+	if (o == path) *o++ = '/';
+	*o = 0;
+}
+
+//Parse a byte count with an optional k, m or g suffix
+long parse_size(char *const s) {
+	char *e;
+	long n = strtol(s, &e, 0);
+	
+	switch (*e) {
+		case 'g': case 'G': n *= 1024;
+		case 'm': case 'M': n *= 1024;
+		case 'k': case 'K': n *= 1024;
+	}
+	
+	return n;
+}
+
+//Encode S as a file name: runs of printable characters prefixed with their length as a letter, other bytes as two letters
+char *escapestr(unsigned char *s) {
+	unsigned char *o = malloc(BUFSIZ);
+
+	memset(o, 0, BUFSIZ);
+	
+	int j;
+
+	int oi = 0;
+	for (int i=0; i<strlen(s); i++) {
+		for (j=i; s[j] &&
+			 	  s[j] != '/' &&
+			 	  s[j] < 0x80 &&
+			 	  s[j] > 0x1f; j++);
+		j -= i;
+		if (j > 0) {
+			if (j > 25) j = 25;
+			o[oi] = 'A'+j; oi++;
+			memcpy(o+oi, s+i, j); oi += j, i += j;
+			i--;
+		} else {
+			o[oi] = (s[i]>>4)+'a'; oi++;
+			o[oi] = (s[i]%16)+'a'; oi++;
+		}
+	}
+	
+	return o;
+}
@@ -2,8 +2,6 @@
 #include <stdint.h>
 
 int needle(char *n, char **h, int lh);
-char *compile(char *script);
-void exec(char *binscript);
 int search_begin(char **restrict array, int num_elements, char *restrict string);
 int startswith(char *s, char *c);
 int endswith(char *restrict s, char *restrict end);
@@ -11,3 +9,6 @@ char *combine(char *restrict a, char *restrict b);
 char *ntoken(char *const s, char *d, int t);
 int count(char *const s, char c, int l);
 uint32_t parse_ip(char *const s);
+void normpath(char *path);
+long parse_size(char *const s);
+char *escapestr(unsigned char *s);
@@ -0,0 +1,330 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ Access log: each worker formats its lines into a ring of its own, which only it writes and only the log thread
+ empties, so no request waits for a lock or a write(). The log thread collects every ring in one writev() a few
+ times a second, or as soon as one of them is half full. Lines that don't fit are counted and dropped.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include "server.h"
+
+#define LOG_RING (1 << 20) //Bytes each worker can have waiting to be written
+#define LOG_FIELD 1024 //Bytes a request line, path or header value takes at most once escaped
+#define LOG_LINE (8*LOG_FIELD) //Longest line, so fields are cut but the line never is
+#define LOG_INTERVAL 100 //Milliseconds lines may wait while no ring is filling up
+#define LOG_BATCH 512 //Rings written per writev(), two buffers each at most
+
+/* Single producer, single consumer; HEAD and TAIL count every byte ever written and taken */
+struct LogRing {
+	char *buf;
+	unsigned long head; //Worker's
+	unsigned long tail __attribute__((aligned(64))); //Log thread's
+	unsigned long dropped;
+	time_t stamp; //Second DATE was formatted for
+	char date[40];
+	int datelen;
+};
+
+extern Worker *workers;
+extern int nworkers;
+
+int log_format = LOG_COMMON;
+char *log_path; //NULL for stdout
+
+static int outfd = -1;
+static int wakefd = -1;
+static bool color;
+static pthread_mutex_t flushlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A worker's ring, NULL if nothing is logged */
+LogRing *TigerLogRing() {
+	LogRing *r;
+
+	if (log_format == LOG_OFF) return NULL;
+	if (!(r = calloc(1, sizeof(LogRing))) || !(r->buf = malloc(LOG_RING))) {
+		perror("malloc()");
+		exit(1);
+	}
+	r->stamp = -1;
+	return r;
+}
+
+typedef struct {
+	char *p, *end;
+} Line;
+
+static void put(Line *l, const char *s, int len) {
+	len = min(len, (int)(l->end-l->p));
+	memcpy(l->p, s, len);
+	l->p += len;
+}
+
+static void putstr(Line *l, const char *s) {
+	put(l, s, strlen(s));
+}
+
+/* Append LEN bytes of S, escaped for a quoted field: \xHH in text formats, \u00HH in JSON */
+static void putesc(Line *l, const char *s, int len) {
+	static const char hex[] = "0123456789abcdef";
+	char *stop = min(l->end, l->p+LOG_FIELD);
+
+	for (int i=0; i<len && stop-l->p >= 6; i++) {
+		unsigned char c = s[i];
+		if (c >= ' ' && c < 0x7f && c != '"' && c != '\\') {
+			*l->p++ = c;
+		} else if (log_format == LOG_JSON && (c == '"' || c == '\\')) {
+			*l->p++ = '\\';
+			*l->p++ = c;
+		} else {
+			put(l, log_format == LOG_JSON ? "\\u00" : "\\x", log_format == LOG_JSON ? 4 : 2);
+			*l->p++ = hex[c>>4];
+			*l->p++ = hex[c&15];
+		}
+	}
+}
+
+/* A header's value, or "-" without one, which JSON leaves empty */
+static void putheader(Line *l, Connection *conn, int hdr) {
+	Slice *s = TigerHeader(&conn->req, hdr);
+
+	if (s && s->len) putesc(l, conn->reqbuff+s->off, s->len);
+	else if (log_format != LOG_JSON) putstr(l, "-");
+}
+
+/* The request line as the client sent it, as far as it was parsed */
+static void putrequest(Line *l, Connection *conn) {
+	RequestData *req = &conn->req;
+	Slice *last = req->protocol.len ? &req->protocol : req->target.len ? &req->target : &req->rverb;
+
+	if (!req->rverb.len) putstr(l, "-");
+	else putesc(l, conn->reqbuff+req->rverb.off, last->off+last->len-req->rverb.off);
+}
+
+/* Status codes by class, for a terminal: 2xx green, 3xx cyan, 4xx yellow, 5xx and no response red */
+static void putstatus(Line *l, int status) {
+	static const char *colors[] = {"31", "32", "32", "36", "33", "31"};
+	char num[16];
+
+	if (color) {
+		put(l, "\x1b[", 2);
+		putstr(l, colors[min(status/100, 5)]);
+		put(l, "m", 1);
+	}
+	put(l, num, snprintf(num, sizeof num, "%d", status));
+	if (color) put(l, "\x1b[0m", 4);
+}
+
+/* The request's time, formatted once a second */
+static void putdate(Line *l, LogRing *r) {
+	time_t t = time(NULL);
+	struct tm tm;
+
+	if (t != r->stamp) {
+		r->stamp = t;
+		if (log_format == LOG_JSON) r->datelen = strftime(r->date, sizeof r->date, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+		else r->datelen = strftime(r->date, sizeof r->date, "%d/%b/%Y:%H:%M:%S %z", localtime_r(&t, &tm));
+	}
+	put(l, r->date, r->datelen);
+}
+
+static void push(LogRing *r, const char *line, int len) {
+	unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	unsigned long head = r->head;
+
+	if (head+len-tail > LOG_RING) {
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	int off = head % LOG_RING, first = min(len, LOG_RING-off);
+	memcpy(r->buf+off, line, first);
+	memcpy(r->buf, line+first, len-first);
+	__atomic_store_n(&r->head, head+len, __ATOMIC_RELEASE);
+
+	//Only crossing the middle wakes the log thread, otherwise it comes by on its own
+	if (head-tail < LOG_RING/2 && head+len-tail >= LOG_RING/2) eventfd_write(wakefd, 1);
+}
+
+/* Log the request CONN has just been answered, before it leaves the buffer */
+void TigerLogRequest(Connection *conn) {
+	LogRing *r = conn->worker->log;
+	RequestData *req = &conn->req;
+	unsigned char *ip = (unsigned char *)&conn->addr.sin_addr.s_addr;
+	char line[LOG_LINE], num[64];
+	Line l = {line, line+sizeof(line)-1};
+
+	if (!r) return;
+
+	if (log_format == LOG_JSON) {
+		putstr(&l, "{\"time\":\"");
+		putdate(&l, r);
+		put(&l, num, snprintf(num, sizeof num, "\",\"remote\":\"%d.%d.%d.%d\",\"method\":\"", ip[0], ip[1], ip[2], ip[3]));
+		putesc(&l, conn->reqbuff+req->rverb.off, req->rverb.len);
+		putstr(&l, "\",\"target\":\"");
+		putesc(&l, conn->reqbuff+req->target.off, req->target.len);
+		putstr(&l, "\",\"protocol\":\"");
+		putesc(&l, conn->reqbuff+req->protocol.off, req->protocol.len);
+		put(&l, num, snprintf(num, sizeof num, "\",\"status\":%d,\"bytes\":%ld,\"referer\":\"", conn->status, conn->bodylen));
+		putheader(&l, conn, HDR_REFERER);
+		putstr(&l, "\",\"user_agent\":\"");
+		putheader(&l, conn, HDR_USER_AGENT);
+		putstr(&l, "\"}");
+	} else {
+		put(&l, num, snprintf(num, sizeof num, "%d.%d.%d.%d - - [", ip[0], ip[1], ip[2], ip[3]));
+		putdate(&l, r);
+		putstr(&l, "] \"");
+		putrequest(&l, conn);
+		putstr(&l, "\" ");
+		putstatus(&l, conn->status);
+		if (conn->bodylen) put(&l, num, snprintf(num, sizeof num, " %ld", conn->bodylen));
+		else putstr(&l, " -");
+		if (log_format == LOG_COMBINED) {
+			putstr(&l, " \"");
+			putheader(&l, conn, HDR_REFERER);
+			putstr(&l, "\" \"");
+			putheader(&l, conn, HDR_USER_AGENT);
+			putstr(&l, "\"");
+		}
+	}
+
+	//LINE keeps a byte for this even when the fields filled it
+	*l.p++ = '\n';
+	push(r, line, l.p-line);
+}
+
+/* Write everything in IOV, dropping it if the log can't be written */
+static void writeall(struct iovec *iov, int niov) {
+	static bool failed;
+
+	while (niov) {
+		ssize_t w = writev(outfd, iov, niov);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			if (!failed) perror("Access log");
+			failed = true;
+			return;
+		}
+		while (niov && w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	failed = false;
+}
+
+/* Write out the lines every worker has logged so far */
+void TigerLogFlush() {
+	Worker *all = __atomic_load_n(&workers, __ATOMIC_ACQUIRE);
+	static unsigned long reported;
+	unsigned long dropped = 0;
+
+	if (!all || outfd < 0) return;
+	pthread_mutex_lock(&flushlock);
+
+	for (int first=0; first<nworkers; first+=LOG_BATCH) {
+		struct iovec iov[2*LOG_BATCH];
+		unsigned long heads[LOG_BATCH];
+		int n = min(nworkers-first, LOG_BATCH), niov = 0;
+
+		for (int i=0; i<n; i++) {
+			LogRing *r = all[first+i].log;
+			if (!r) continue;
+
+			heads[i] = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+
+			unsigned long len = heads[i]-r->tail;
+			int off = r->tail % LOG_RING;
+			if (!len) continue;
+			iov[niov++] = (struct iovec){r->buf+off, min(len, (unsigned long)(LOG_RING-off))};
+			if (len > LOG_RING-off) iov[niov++] = (struct iovec){r->buf, len-(LOG_RING-off)};
+		}
+
+		writeall(iov, niov);
+		for (int i=0; i<n; i++) {
+			if (all[first+i].log) __atomic_store_n(&all[first+i].log->tail, heads[i], __ATOMIC_RELEASE);
+		}
+	}
+
+	if (dropped != reported) {
+		fprintf(stderr, "Access log: %lu lines dropped, the log can't keep up\n", dropped-reported);
+		reported = dropped;
+	}
+	pthread_mutex_unlock(&flushlock);
+}
+
+static void *logmain(void *arg) {
+	while (true) {
+		struct pollfd pfd = {wakefd, POLLIN};
+		eventfd_t n;
+
+		if (poll(&pfd, 1, LOG_INTERVAL) > 0) eventfd_read(wakefd, &n);
+		TigerLogFlush();
+	}
+	return NULL;
+}
+
+/* Open the access log and start writing it; colors are only used on a terminal */
+void TigerLogStart() {
+	pthread_t thread;
+	int err;
+
+	if (log_format == LOG_OFF) return;
+
+	if (!log_path) {
+		outfd = STDOUT_FILENO;
+		color = log_format != LOG_JSON && isatty(outfd);
+	} else if ((outfd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+		perror(log_path);
+		exit(1);
+	}
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("eventfd()");
+		exit(1);
+	}
+
+	//Whatever was printed before is older than any request
+	fflush(stdout);
+
+	if ((err = pthread_create(&thread, NULL, logmain, NULL))) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+		exit(1);
+	}
+	pthread_detach(thread);
+}
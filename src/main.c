@@ -29,9 +29,9 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <signal.h>
-#include "hirolib.h"
 #include "server.h"
 #include "librsl.h"
+#include "daemon.h"
 #include "c-stacktrace.h"
 
 extern char *verbs[];
@@ -39,21 +39,16 @@ extern char *verbs[];
 extern bool disable_cache;
 extern bool disable_redirect;
 extern bool disable_error;
+extern bool stats_enabled;
 extern uint32_t ip_whitelist;
 extern uint32_t ip_mask;
 
 bool create_daemon = false;
 
-void sigpipe() {
-	printf("(Probably Bogus) ");
-}
+char rootpath[PATH_MAX];
 
-int filesize(FILE *fp) {
-	int os = ftell(fp);
-	fseek(fp, 0, SEEK_END);
-	int s = ftell(fp);
-	fseek(fp, os, SEEK_SET);
-	return s;
+/* Broken connections show up as EPIPE; a handler, unlike SIG_IGN, isn't passed on to the programs Tiger starts */
+void sigpipe() {
 }
 
 void logdata(char *data) {
@@ -64,38 +59,20 @@ void logdata(char *data) {
 	}
 }
 
-int TigerInit(unsigned short port);
-loadFile_returnData TigerLoadFile(char *pubpath, char *cachepath, int csock);
-RequestData *TigerParseRequest(const char *const reqbuff, char *rootpath);
-int TigerCallPHP(char *source_path, char *output_path, RequestData data, loadFile_returnData *output);
-
-char *escapestr(unsigned char *s) {
-	unsigned char *o = malloc(BUFSIZ);
-
-	memset(o, 0, BUFSIZ);
-	
-	int j;
+loadFile_returnData TigerLoadFile(char *path);
+ScriptTable *TigerLoadScripts();
+void TigerSetScripts(ScriptTable *t);
+void TigerExecScript(LoadedScript *script, Connection *conn);
+LoadedScript *TigerSearchScript(char *path, int pathlen);
 
-	int oi = 0;
-	for (int i=0; i<strlen(s); i++) {
-		for (j=i; s[j] &&
-			 	  s[j] != '/' &&
-			 	  s[j] < 0x80 &&
-			 	  s[j] > 0x1f; j++);
-		j -= i;
-		if (j > 0) {
-			if (j > 25) j = 25;
-			o[oi] = 'A'+j; oi++;
-			memcpy(o+oi, s+i, j); oi += j, i += j;
-			i--;
-		} else {
-			o[oi] = (s[i]>>4)+'a'; oi++;
-			o[oi] = (s[i]%16)+'a'; oi++;
-		}
-	}
-	
-	return o;
-}
+extern long cache_budget;
+extern long page_budget;
+extern int idle_timeout;
+extern int max_requests;
+extern bool draining;
+extern char *fastcgi_addr;
+extern int log_format;
+extern char *log_path;
 
 void usage(char *name) {
 	printf("Usage: %s [OPTIONS]\n", name);
@@ -105,10 +82,22 @@ void usage(char *name) {
 	printf("  -c [directory]       set working directory to [directory]\n");
 	printf("  -d start             start Tiger as daemon\n");
 	printf("  -d stop              stop Tiger daemon\n");
-	printf("  -d restart           restart Tiger daemon\n");
+	printf("  -d restart           restart Tiger daemon without dropping connections\n");
 	printf("  -a                   disable redirecting / to /index.html or /index.php\n");
 	printf("  -n                   disable cache\n");
+	printf("  -M [bytes]           keep at most [bytes] of files in memory (default 64M)\n");
 	printf("  -e                   disable using error pages (e.g. /404.html)\n");
+	printf("  -w [workers]         serve requests with [workers] threads, each with its own listener\n");
+	printf("  -P                   pin each worker thread to a CPU\n");
+	printf("  -k [seconds]         close idle keep-alive connections after [seconds] (default 5)\n");
+	printf("  -r [requests]        serve at most [requests] requests per connection (default 100)\n");
+	printf("  -f [address]         run PHP through the FastCGI server at [address] (a socket path or ip:port)\n");
+	printf("  -F [children]        start php-cgi with [children] processes and run PHP through it\n");
+	printf("  -C [file]            cache PHP responses following the rules in [file]\n");
+	printf("  -B [bytes]           keep at most [bytes] of cached PHP responses in memory (default 16M)\n");
+	printf("  -l [format]          access log format: common (default), combined, json or off\n");
+	printf("  -L [file]            append the access log to [file] instead of printing it\n");
+	printf("  -s                   serve statistics at /__tiger/stats and /__tiger/metrics\n");
 	printf("\n");
 	printf("An IP address can be specified in one of the following ways:\n");
 	printf("    127.0.0.1\n");
@@ -117,19 +106,131 @@ void usage(char *name) {
 	printf("    0xdeadbeef\n");
 }
 
+void TigerHandleRequest(Connection *conn) {
+	RequestData *reqdata = &conn->req;
+	loadFile_returnData read_data;
+	struct PageFill *fill;
+	
+	/* Reject requests the parser refused */
+	
+	switch (reqdata->error) {
+		case 0:
+			break;
+		
+		//using HTTP/0.9
+		case PARSE_HTTP09:
+			return;
+		
+		default:
+			TigerErrorHandler(reqdata->error, conn, rootpath);
+			return;
+	}
+	
+	if (!TigerDecodePath(reqdata, conn->reqbuff)) {
+		TigerErrorHandler(400, conn, rootpath);
+		return;
+	}
+	
+	/* HTTP/1.1 connections persist unless the client asks otherwise; HTTP/1.0 ones only on request */
+	if (reqdata->minor == 1) {
+		conn->keepalive = reqdata->connection != CONN_HDR_CLOSE;
+	} else {
+		conn->keepalive = reqdata->connection == CONN_HDR_KEEPALIVE;
+	}
+	if (conn->eof || conn->nrequests >= max_requests || __atomic_load_n(&draining, __ATOMIC_RELAXED)) conn->keepalive = false;
+	
+	conn->headonly = reqdata->verb == VERB_HEAD;
+	
+	/* If verb is OPTIONS return allowed options (GET, OPTIONS, HEAD) */
+	if (reqdata->verb == VERB_OPTIONS) {
+		TigerConnHeader(conn, 200, 0, "Allow: OPTIONS, GET, HEAD\r\n");
+		return;
+	}
+	
+	if (TigerStatsServe(conn)) return;
+	
+	/* Network scripts are answered in-process, before any file is looked at */
+	LoadedScript *script = TigerSearchScript(reqdata->truepath, strlen(reqdata->truepath));
+	if (script) {
+		int verb = reqdata->verb == VERB_HEAD ? VERB_GET : reqdata->verb;
+		if (script->supp_methods[verb]) TigerExecScript(script, conn);
+		else TigerErrorHandler(405, conn, rootpath);
+		return;
+	}
+	
+	/* Fetch file, redirecting / to index.html or index.php */
+	if (!disable_redirect && !strcmp(reqdata->truepath, "/")) {
+		if ((read_data = TigerLoadFile("/index.html")).entry) {
+			strcpy(reqdata->truepath, "/index.html");
+		} else if ((read_data = TigerLoadFile("/index.php")).entry) {
+			strcpy(reqdata->truepath, "/index.php");
+		}
+	} else {
+		read_data = TigerLoadFile(reqdata->truepath);
+	}
+	
+	if (read_data.entry) TigerStatsCache(conn->worker, read_data.type == 1);
+	
+	/* If file doesn't exist in public directory return 404 Not Found */
+	if (!read_data.entry) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			TigerErrorHandler(404, conn, rootpath);
+		} else {
+			fprintf(stderr, "%s: %s\n", reqdata->truepath, strerror(errno));
+			TigerErrorHandler(500, conn, rootpath);
+		}
+		return;
+	}
+	
+	if (endswith(reqdata->truepath, ".php")) {
+		TigerCacheRelease(read_data.entry);
+		
+		/* Pages with a cache rule may be answered without running PHP at all */
+		if (TigerPageLookup(conn, &fill) != PAGE_MISS) return;
+		
+		/* The response is streamed back through the event loop, from FastCGI or a php process */
+		if (!TigerRunPHP(conn, fill)) {
+			fprintf(stderr, "%s: %s\n", reqdata->truepath, strerror(errno));
+			TigerPageEnd(fill, false);
+			TigerErrorHandler(fastcgi_addr ? 502 : 500, conn, rootpath);
+		}
+		return;
+	}
+
+	/* Ranges always refer to the plain file, other requests may get a compressed variant */
+	if (!TigerHeader(reqdata, HDR_RANGE)) {
+		read_data.entry = TigerCacheVariant(read_data.entry, TigerAcceptEncoding(reqdata, conn->reqbuff));
+	}
+	
+	/* Send response, or just the validators if the client's copy is current */
+	
+	if (TigerNotModified(conn, read_data.entry)) {
+		TigerConnNotModified(conn, read_data.entry);
+		TigerCacheRelease(read_data.entry);
+		return;
+	}
+	
+	if (TigerConnRange(conn, read_data.entry)) {
+		TigerCacheRelease(read_data.entry);
+		return;
+	}
+	
+	TigerConnHeaderEntry(conn, read_data.entry);
+	TigerConnBodyEntry(conn, read_data.entry, 0, read_data.entry->len);
+	TigerCacheRelease(read_data.entry);
+}
+
 int main(int argc, char **argv) {
-	char *buffer;
-	char scriptpath[PATH_MAX];
-	struct dirent *ent;
-	FILE *fp;
-	int len;
-	int sn = 0;
 	unsigned short port;
-	char *tmp;
+	int nworkers = 1;
+	bool pin_workers = false;
+	int php_children = 0;
 	
 	char *fullpath = calloc(1, 64);
 	fullpath = getcwd(fullpath, 64);
 	
+	TigerUpgradeInit(argv);
+	
 	printf("Tiger "TIGER_VERS"\n");
 
 	signal(SIGPIPE, sigpipe);
@@ -150,6 +251,103 @@ int main(int argc, char **argv) {
 					case 'n': disable_cache = true; break;
 					case 'a': disable_redirect = true; break;
 					case 'e': disable_error = true; break;
+					case 'P': pin_workers = true; break;
+					case 's': stats_enabled = true; break;
+					case 'M': //cache budget
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						cache_budget = parse_size(argv[i]);
+						goto skip_arg;
+					case 'k': //keep-alive timeout
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						idle_timeout = strtol(argv[i], NULL, 0);
+						goto skip_arg;
+					case 'r': //max requests per connection
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						max_requests = strtol(argv[i], NULL, 0);
+						goto skip_arg;
+					case 'f': //FastCGI server
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						fastcgi_addr = argv[i];
+						goto skip_arg;
+					case 'F': //php-cgi children
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						php_children = strtol(argv[i], NULL, 0);
+						if (php_children < 1) {
+							usage(argv[0]);
+							exit(1);
+						}
+						goto skip_arg;
+					case 'C': //page cache rules
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						TigerPageRules(argv[i]);
+						goto skip_arg;
+					case 'B': //page cache budget
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						page_budget = parse_size(argv[i]);
+						goto skip_arg;
+					case 'l': //access log format
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						if (!strcmp(argv[i], "off")) log_format = LOG_OFF;
+						else if (!strcmp(argv[i], "common")) log_format = LOG_COMMON;
+						else if (!strcmp(argv[i], "combined")) log_format = LOG_COMBINED;
+						else if (!strcmp(argv[i], "json")) log_format = LOG_JSON;
+						else {
+							usage(argv[0]);
+							exit(1);
+						}
+						goto skip_arg;
+					case 'L': //access log file
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						log_path = argv[i];
+						goto skip_arg;
+					case 'w': //workers
+						i++;
+						if (!(i < argc)) {
+							usage(argv[0]);
+							exit(1);
+						}
+						nworkers = strtol(argv[i], NULL, 0);
+						if (nworkers < 1) {
+							usage(argv[0]);
+							exit(1);
+						}
+						goto skip_arg;
 					case 'i': //ip whitelist
 						i++;
 						if (!(i < argc)) {
@@ -216,7 +414,14 @@ int main(int argc, char **argv) {
 							return 1;
 						}
 						
-						if (!strcmp(argv[i], "stop")  | !strcmp(argv[i], "restart")) daemon_stop();
+						//A process taking over from the daemon already runs as one
+						if (TigerUpgrading()) {
+							create_daemon = true;
+							goto skip_arg;
+						}
+						
+						if (!strcmp(argv[i], "restart") && daemon_restart()) return 0;
+						if (!strcmp(argv[i], "stop")) daemon_stop();
 						if (!strcmp(argv[i], "start") | !strcmp(argv[i], "restart")) daemon_start();
 						if (!strcmp(argv[i], "stop")) return 0;
 						goto skip_arg;
@@ -233,182 +438,27 @@ int main(int argc, char **argv) {
 	
 	printf("Port: %d\n\n", port);
 	
-	if (create_daemon) daemon_init();
+	if (create_daemon && !TigerUpgrading()) daemon_init();
 	
-	int serversock = TigerInit(port);
-	
-	char rootpath[PATH_MAX];
 	char cwdbuffer[PATH_MAX];
-	loadFile_returnData read_data;
 	
 	/* Get server path */
 	getcwd(cwdbuffer, PATH_MAX);
 	strncpy(rootpath, cwdbuffer, PATH_MAX);
 	
-	strncpy(rootpath, fullpath, PATH_MAX);
-	strncat(rootpath, "/", PATH_MAX);
+	snprintf(rootpath, PATH_MAX, "%s/", fullpath);
 	
 	printf("Using directory %s\n", rootpath);
 	
-	int csock;
-	int statcode;
-	int script;
-	int bodylen;
-	
-	struct sockaddr_in caddr;
-	socklen_t caddrl;
-	char reqbuff[BUFSIZ];
-	char *resbuff = malloc(BUFSIZ);
-	
-	if (!resbuff) {
-		perror("malloc");
-		return -1;
-	}
-	
-	RequestData *reqdata;
-	
-	FILE *tmpfp;
+	/* Restart gracefully on SIGUSR2 and exit cleanly on SIGTERM; before any thread is started, they must all leave the signals to it */
+	TigerUpgradeListen();
+	TigerLogStart();
 	
-	FILE *publicfp;
-	FILE *cachedfp;
+	/* Load network scripts; the watcher reloads them and drops cached files as they change */
+	TigerSetScripts(TigerLoadScripts());
+	TigerWatch();
 	
-	char public_path[PATH_MAX];
-	char cached_path[PATH_MAX];
-	char phpoutput_path[PATH_MAX];
-	char *line;
-	char *body;
+	if (php_children) TigerFcgiSpawn(php_children);
 	
-	while (true) {
-		/* Accept */
-		csock = accept(serversock, &caddr, &caddrl);
-		
-		if (ip_whitelist & caddr.sin_addr.s_addr) {
-			if (ntohl(caddr.sin_addr.s_addr) != ip_whitelist) goto block_req;
-		}
-		
-		printf("%d.%d.%d.%d ",
-			   caddr.sin_addr.s_addr%256,
-			   (caddr.sin_addr.s_addr>>8)%256,
-			   (caddr.sin_addr.s_addr>>16)%256,
-			   (caddr.sin_addr.s_addr>>24)%256
-		);
-		
-		/* Clear buffers */
-		memset(resbuff, 0, BUFSIZ);
-		memset(reqbuff, 0, BUFSIZ);
-		memset(&reqdata, 0, sizeof(reqdata));
-		
-		/* Read request */
-		read(csock, reqbuff, BUFSIZ);
-		
-		/* Parse request */
-		
-		if (!(reqdata = TigerParseRequest(reqbuff, rootpath))) {
-			switch (errno) {
-				//using HTTP/0.9
-				case 1:
-				case 2:
-					SetColor16(COLOR_RED);
-					printf("HTTP/0.9 ");
-					ResetColor16();
-					goto endreq;
-				
-				//Invalid verb
-				case 3:
-					SetColor16(COLOR_RED);
-					printf("Invalid Verb ");
-					ResetColor16();
-					
-					TigerErrorHandler(501, resbuff, reqdata);
-					write(csock, resbuff, strlen(resbuff));
-					goto endreq;
-			}
-		}
-		
-		//printf("%s\n", reqdata->path);
-		
-		reqdata->truepath = ntoken(reqdata->path, "?", 0);
-
-		/* TODO: Parse headers */
-		
-		/* If verb is OPTIONS return allowed options (GET, OPTIONS, HEAD) */
-		if (reqdata->verb == VERB_OPTIONS) {
-			SetColor16(COLOR_BLUE);
-			printf("OPTIONS");
-			ResetColor16();
-			snprintf(resbuff, BUFSIZ, "HTTP/1.0 200 OK\r\nServer: Tiger/"TIGER_VERS"\r\nAllow: OPTIONS, GET, HEAD\r\n");
-			write(csock, resbuff, strlen(resbuff));
-			goto endreq;
-			
-		}
-		
-		/* Fetch file */
-		memset(public_path, 0, PATH_MAX);
-		snprintf(public_path, sizeof public_path, "%s/public/%s", rootpath, reqdata->truepath);
-		
-		/* If file doesn't exist in public directory return 404 Not Found */
-		if (!(publicfp = fopen(public_path, "r"))) {
-			if (errno == 2) {
-				SetColor16(COLOR_RED);
-				printf("%s ", reqdata->truepath);
-				ResetColor16();
-				TigerErrorHandler(404, resbuff, *reqdata, rootpath);
-			} else {
-				SetColor16(COLOR_RED);
-				ResetColor16();
-				printf("ERROR %d ", errno);
-				TigerErrorHandler(500, resbuff, *reqdata, rootpath);
-			}
-			write(csock, resbuff, strlen(resbuff));
-			goto endreq;
-		}
-		
-		fclose(publicfp);
-		
-		/* File exists */
-		//printf("%s ", reqdata->truepath);
-		memset(cached_path, 0, PATH_MAX);
-		snprintf(cached_path, sizeof cached_path, "%s/cache/%s", rootpath, tmp = escapestr(reqdata->truepath));
-		free(tmp);
-		snprintf(phpoutput_path, sizeof cached_path, "%s/cache/%s.html", rootpath, tmp = escapestr(reqdata->truepath));
-
-		//printf("%s %s\n", cached_path, public_path);
-
-		read_data = TigerLoadFile(public_path, cached_path, csock);
-		
-		//printf("'%s' %d %d\n", read_data.data, read_data.datalen, read_data.type);
-		
-		if (endswith(reqdata->truepath, ".php")) {
-			free(read_data.data);
-			int ret = TigerCallPHP(disable_cache?cached_path:public_path, phpoutput_path, *reqdata, &read_data);
-			if (ret) {
-				goto response;
-			} else {
-				TigerErrorHandler(500, resbuff, *reqdata, rootpath);
-				goto endreq;
-			}
-		}
-
-response:
-		/* Send response */
-		
-		sprintf(resbuff,"HTTP/1.0 200 OK\r\nServer: Tiger/"TIGER_VERS"\r\n\r\n");
-		write(csock, resbuff, strlen(resbuff));
-		
-		/* Finish and flush */
-		fflush(stdout);
-
-		write(csock, read_data.data, read_data.datalen);
-		free(read_data.data);
-		free(reqdata->truepath);
-		free(reqdata);
-		
-endreq:
-		/* Finish and flush */
-		putchar('\n');
-		fflush(stdout);
-		
-block_req:
-		close(csock);
-	}
+	TigerStartWorkers(port, nworkers, pin_workers);
 }
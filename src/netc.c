@@ -16,35 +16,291 @@
  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+/*
+ netc, the network script compiler. A source file holds scripts like
+
+	path /ping*
+		supports-verb GET
+		return 65535 pong
+	end
+
+ which compile to a single .bns, or, with -b, every .net file of a directory compiles to one bundle Tiger maps at startup.
+*/
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include "bns.h"
+
+/* Same order as HTTPVerb */
+static const char *verbs[] = {"GET", "POST", "PUT", "PATCH", "DELETE", "HEAD", "OPTIONS"};
+
+typedef struct {
+	char *paths[16];
+	int npaths;
+	unsigned char supp_methods[8];
+	unsigned char *code;
+	int codelen;
+	int ninst;
+} Script;
+
+static const char *srcname;
+static int srcline;
+
+static void fail(const char *msg) {
+	fprintf(stderr, "%s:%d: %s\n", srcname, srcline, msg);
+	exit(1);
+}
+
+static void *xrealloc(void *p, size_t size) {
+	if (!(p = realloc(p, size))) {
+		perror("realloc()");
+		exit(1);
+	}
+	return p;
+}
+
+static void emit(Script *s, const void *data, int len) {
+	s->code = xrealloc(s->code, s->codelen+len);
+	memcpy(s->code+s->codelen, data, len);
+	s->codelen += len;
+}
+
+/* Compile the scripts in SRC; returns how many were put in *OUT */
+static int compile(char *src, Script **out) {
+	Script *scripts = NULL, *s = NULL;
+	int n = 0;
+	char *save;
+
+	srcline = 0;
+	for (char *line = src; line; line = save) {
+		char *arg, *end;
+
+		if ((save = strchr(line, '\n'))) *save++ = 0;
+		srcline++;
+
+		while (isspace(*line)) line++;
+		end = line+strlen(line);
+		while (end > line && isspace(end[-1])) *--end = 0;
+		if (!*line || *line == '#') continue;
+
+		for (arg = line; *arg && !isspace(*arg); arg++);
+		if (*arg) *arg++ = 0;
+		while (isspace(*arg)) arg++;
+
+		if (!s && strcmp(line, "path")) fail("expected 'path' to start a script");
+
+		if (!strcmp(line, "path")) {
+			if (!*arg) fail("'path' needs a pattern");
+			if (!s) {
+				scripts = xrealloc(scripts, (n+1)*sizeof(Script));
+				s = memset(&scripts[n++], 0, sizeof(Script));
+			} else if (s->codelen || s->ninst) {
+				fail("paths have to come before the script's instructions");
+			}
+			if (s->npaths == 16) fail("a script can't have more than 16 paths");
+			s->paths[s->npaths++] = strdup(arg);
+		} else if (!strcmp(line, "supports-verb")) {
+			int v;
+			for (v=0; v<sizeof(verbs)/sizeof(verbs[0]) && strcmp(verbs[v], arg); v++);
+			if (v == sizeof(verbs)/sizeof(verbs[0])) fail("unknown verb");
+			s->supp_methods[v] = 1;
+		} else if (!strcmp(line, "return")) {
+			long status = strtol(arg, &end, 10);
+			if (end == arg || (*end && !isspace(*end)) || ((status < 100 || status > 599) && status != 0xffff)) fail("'return' needs a status between 100 and 599, or 65535");
+			emit(s, (unsigned char[]){INST_RETURN, status & 0xff, status >> 8, 0}, sizeof(NSInstruction));
+			s->ninst++;
+			while (isspace(*end)) end++;
+			if (*end) {
+				emit(s, (unsigned char[]){INST_STRING_PACKET}, 1);
+				emit(s, end, strlen(end)+1);
+				s->ninst++;
+			}
+		} else if (!strcmp(line, "end")) {
+			s = NULL;
+		} else {
+			fail("unknown statement");
+		}
+	}
+
+	if (s) fail("missing 'end'");
+
+	*out = scripts;
+	return n;
+}
+
+static char *readfile(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	char *buffer;
+	long len;
+
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (!(buffer = malloc(len+1)) || fread(buffer, 1, len, fp) != len) {
+		perror(path);
+		exit(1);
+	}
+	buffer[len] = 0;
+	fclose(fp);
+	return buffer;
+}
 
-char *compile(char *code, int *len);
+/* Write DATA to a temporary file and move it over PATH, so a running server never sees half of it */
+static void writefile(const char *path, const void *data, size_t len) {
+	char tmp[4096];
+	FILE *fp;
+
+	snprintf(tmp, sizeof tmp, "%s.tmp", path);
+	if (!(fp = fopen(tmp, "wb")) || fwrite(data, 1, len, fp) != len || fclose(fp) || rename(tmp, path)) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static int isnet(const struct dirent *ent) {
+	int len = strlen(ent->d_name);
+	return len > 4 && !strcmp(ent->d_name+len-4, ".net");
+}
+
+/* Lay SCRIPTS out as a bundle, see NSBundleHeader */
+static void writebundle(const char *path, Script *scripts, int n) {
+	NSBundleHeader h = {"netb", NETC_VERSION_MAJOR, NETC_VERSION_MINOR};
+	int nroutes = 0, stringslen = 0, codelen = 0;
+
+	for (int i=0; i<n; i++) {
+		nroutes += scripts[i].npaths;
+		for (int j=0; j<scripts[i].npaths; j++) stringslen += strlen(scripts[i].paths[j])+1;
+		codelen += scripts[i].codelen;
+	}
+
+	h.scripts = sizeof(h);
+	h.nscripts = n;
+	h.routes = h.scripts + n*sizeof(NSBundleScript);
+	h.nroutes = nroutes;
+	h.strings = h.routes + nroutes*sizeof(unsigned int);
+	h.stringslen = stringslen;
+	h.code = (h.strings + stringslen + 3) & ~3;
+	h.codelen = codelen;
+
+	size_t len = h.code + codelen;
+	char *out = calloc(1, len);
+	if (!out) {
+		perror("calloc()");
+		exit(1);
+	}
+
+	NSBundleScript *table = (NSBundleScript *)(out+h.scripts);
+	unsigned int *routes = (unsigned int *)(out+h.routes);
+	int route = 0, string = 0, code = 0;
+
+	for (int i=0; i<n; i++) {
+		table[i] = (NSBundleScript){code, scripts[i].codelen, route, scripts[i].npaths};
+		memcpy(table[i].supp_methods, scripts[i].supp_methods, sizeof(table[i].supp_methods));
+		for (int j=0; j<scripts[i].npaths; j++) {
+			routes[route++] = string;
+			strcpy(out+h.strings+string, scripts[i].paths[j]);
+			string += strlen(scripts[i].paths[j])+1;
+		}
+		memcpy(out+h.code+code, scripts[i].code, scripts[i].codelen);
+		code += scripts[i].codelen;
+	}
+
+	h.checksum = NSChecksum(out+sizeof(h), len-sizeof(h));
+	memcpy(out, &h, sizeof(h));
+	writefile(path, out, len);
+	free(out);
+}
+
+/* Lay a single script out as a .bns, see NSHeader */
+static void writescript(const char *path, Script *s) {
+	NSHeader h;
+	int pos = 0;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "nets", 4);
+	h.ver_major = NETC_VERSION_MAJOR;
+	h.ver_minor = NETC_VERSION_MINOR;
+	memcpy(h.supp_methods, s->supp_methods, sizeof(h.supp_methods));
+	for (int i=0; i<s->npaths; i++) {
+		int plen = strlen(s->paths[i])+1;
+		if (pos+plen > sizeof(h.paths)) {
+			fprintf(stderr, "%s: paths take more than %d bytes, use a bundle\n", srcname, (int)sizeof(h.paths));
+			exit(1);
+		}
+		memcpy(h.paths+pos, s->paths[i], plen);
+		pos += plen;
+	}
+	h.ninst = s->ninst;
+
+	char *out = malloc(sizeof(h)+s->codelen);
+	if (!out) {
+		perror("malloc()");
+		exit(1);
+	}
+	memcpy(out, &h, sizeof(h));
+	memcpy(out+sizeof(h), s->code, s->codelen);
+	writefile(path, out, sizeof(h)+s->codelen);
+	free(out);
+}
 
 int main(int argc, char **argv) {
-	if (argc<3) {
+	Script *scripts = NULL;
+	int n = 0;
+
+	if (argc == 4 && !strcmp(argv[1], "-b")) {
+		struct dirent **list;
+		int nfiles = scandir(argv[2], &list, isnet, alphasort);
+		char path[4096];
+
+		if (nfiles < 0) {
+			perror(argv[2]);
+			return 1;
+		}
+
+		//Files are taken in name order, which is also the order their routes match in
+		for (int i=0; i<nfiles; i++) {
+			Script *more;
+			int nmore;
+
+			snprintf(path, sizeof path, "%s/%s", argv[2], list[i]->d_name);
+			srcname = path;
+			nmore = compile(readfile(path), &more);
+			scripts = xrealloc(scripts, (n+nmore)*sizeof(Script));
+			memcpy(scripts+n, more, nmore*sizeof(Script));
+			n += nmore;
+			free(more);
+			free(list[i]);
+		}
+		free(list);
+
+		if (!n) {
+			fprintf(stderr, "%s: no scripts to bundle\n", argv[2]);
+			return 1;
+		}
+		writebundle(argv[3], scripts, n);
+		printf("%d scripts from %d files\n", n, nfiles);
+		return 0;
+	}
+
+	if (argc != 3) {
 		printf("Usage: %s <file> <output>\n", argv[0]);
+		printf("       %s -b <directory> <bundle>\n", argv[0]);
 		return 1;
 	}
-	FILE *ifp = fopen(argv[1], "r");
-	FILE *ofp = fopen(argv[2], "w");
-	
-	if (!ifp) {
-		perror(argv[1]);
-		return 1;
-	} else if (!ofp) {
-		perror(argv[2]);
+
+	srcname = argv[1];
+	n = compile(readfile(argv[1]), &scripts);
+	if (n != 1) {
+		fprintf(stderr, "%s: a .bns holds one script, found %d; use a bundle\n", argv[1], n);
 		return 1;
 	}
-	
-	fseek(ifp, 0, SEEK_END);
-	char *buffer = malloc(ftell(ifp));
-	fseek(ifp, 0, SEEK_SET);
-	fread(buffer, 1, -1, ifp);
-	
-	int len;
-	char *cbuffer = compile(buffer, &len);
-	fwrite(cbuffer, 1, len, ofp);
-	
+	writescript(argv[2], &scripts[0]);
 	return 0;
 }
@@ -0,0 +1,503 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include "server.h"
+
+#define PAGE_BUCKETS 1024
+#define PAGE_MAX_RULES 64
+#define PAGE_MAX_VARY 8
+#define PAGE_MAX_BODY (1024*1024) //Bigger responses are streamed but never stored
+#define PAGE_MAX_KEY 8192
+#define PAGE_MAX_PAGES 65536 //Keys remembered at most, with or without a response
+#define PAGE_FAIL_TTL 1 //Seconds requests for a page that couldn't be stored go straight through
+
+extern char rootpath[];
+
+long page_budget = 16*1024*1024;
+
+/* Cache the responses of scripts under PREFIX for TTL seconds, and serve them for STALE more while they are regenerated */
+typedef struct {
+	char *prefix;
+	int prefixlen;
+	int ttl;
+	int stale;
+	char *vary[PAGE_MAX_VARY]; //Request headers that are part of the key
+	int nvary;
+} PageRule;
+
+/* A cached response, or a placeholder for one being generated */
+typedef struct Page {
+	char *key;
+	CacheEntry *entry; //Body, with the whole response head in its header; NULL until there is one
+	time_t fresh; //Served as is until then
+	time_t stale; //Served while being regenerated until then
+	bool pass; //The script said not to cache this, requests go straight through until FRESH
+	bool filling; //A request is generating it right now
+	struct PageWaiter *waiters;
+	struct Page *next;
+} Page;
+
+/* A request waiting for someone else's regeneration of the same page */
+typedef struct PageWaiter {
+	int source; //SOURCE_PAGE, must come first
+	Connection *conn; //NULL once the client has gone away
+	Worker *worker;
+	Page *page; //NULL once woken
+	CacheEntry *entry; //What the regeneration left, if anything
+	struct PageWaiter *next;
+} PageWaiter;
+
+/* The copy of a response being generated for the cache */
+typedef struct PageFill {
+	Page *page;
+	PageRule *rule;
+	char head[512];
+	int headlen;
+	char *body;
+	long len, cap;
+	bool failed; //Not storable, e.g. an error or too big
+	bool pass; //Storable, but the script said not to
+} PageFill;
+
+static PageRule rules[PAGE_MAX_RULES];
+static int nrules;
+static Page *buckets[PAGE_BUCKETS];
+static long page_used; //Bodies, keys and pages
+static int npages;
+static time_t lastdrop; //A full table is only searched for expired pages once a second
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hashkey(const char *s) {
+	unsigned h = 2166136261u;
+	while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % PAGE_BUCKETS;
+}
+
+static time_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+/* Read the rules in PATH, one per line: prefix ttl [stale] [header...] */
+void TigerPageRules(const char *path) {
+	char line[BUFSIZ];
+	FILE *fp = fopen(path, "r");
+	int n = 0;
+
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof line, fp)) {
+		char *save;
+		char *prefix = strtok_r(line, " \t\r\n", &save);
+		char *ttl = strtok_r(NULL, " \t\r\n", &save);
+		n++;
+
+		if (!prefix || *prefix == '#') continue;
+		if (*prefix != '/' || !ttl || nrules == PAGE_MAX_RULES) {
+			fprintf(stderr, "%s:%d: bad rule\n", path, n);
+			exit(1);
+		}
+
+		PageRule *r = &rules[nrules++];
+		r->prefix = strdup(prefix);
+		r->prefixlen = strlen(prefix);
+		r->ttl = strtol(ttl, NULL, 10);
+
+		for (char *tok = strtok_r(NULL, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+			if (*tok >= '0' && *tok <= '9' && !r->nvary) r->stale = strtol(tok, NULL, 10);
+			else if (r->nvary < PAGE_MAX_VARY) r->vary[r->nvary++] = strdup(tok);
+		}
+	}
+
+	fclose(fp);
+	printf("Page cache: %d rules\n", nrules);
+}
+
+/* Longest matching prefix wins */
+static PageRule *findrule(const char *path) {
+	PageRule *best = NULL;
+
+	for (int i=0; i<nrules; i++) {
+		if (!strncmp(path, rules[i].prefix, rules[i].prefixlen) && (!best || rules[i].prefixlen > best->prefixlen)) best = &rules[i];
+	}
+	return best;
+}
+
+/* Path, query and the varying request headers, each on its own line */
+static bool makekey(Connection *conn, PageRule *rule, char *key) {
+	RequestData *req = &conn->req;
+	int len = snprintf(key, PAGE_MAX_KEY, "%s?%.*s", req->truepath, req->query.len, conn->reqbuff+req->query.off);
+
+	for (int i=0; i<rule->nvary && len < PAGE_MAX_KEY; i++) {
+		Slice *v = TigerFindHeader(req, conn->reqbuff, rule->vary[i]);
+		len += snprintf(key+len, PAGE_MAX_KEY-len, "\n%.*s", v ? v->len : 0, v ? conn->reqbuff+v->off : "");
+	}
+	return len < PAGE_MAX_KEY;
+}
+
+/* What a page costs besides its body */
+static long pagesize(const char *key) {
+	return sizeof(Page)+strlen(key)+1;
+}
+
+static Page *lookup(const char *key) {
+	for (Page *p = buckets[hashkey(key)]; p; p = p->next) {
+		if (!strcmp(p->key, key)) return p;
+	}
+	return NULL;
+}
+
+/* Must hold page_lock; only pages nobody is using are dropped */
+static void dropexpired(time_t t) {
+	for (int i=0; i<PAGE_BUCKETS; i++) {
+		Page **pp = &buckets[i];
+		while (*pp) {
+			Page *p = *pp;
+			if (p->filling || p->waiters || t < p->stale) {
+				pp = &p->next;
+				continue;
+			}
+			*pp = p->next;
+			if (p->entry) page_used -= p->entry->len;
+			page_used -= pagesize(p->key);
+			npages--;
+			TigerCacheRelease(p->entry);
+			free(p->key);
+			free(p);
+		}
+	}
+}
+
+static void serve(Connection *conn, CacheEntry *entry) {
+	TigerConnHeaderEntry(conn, entry);
+	TigerConnBodyEntry(conn, entry, 0, entry->len);
+	TigerCacheRelease(entry);
+}
+
+static PageFill *newfill(Page *p, PageRule *rule) {
+	PageFill *f = calloc(1, sizeof(PageFill));
+	if (!f) {
+		perror("calloc()");
+		exit(1);
+	}
+	f->page = p;
+	f->rule = rule;
+	p->filling = true;
+	return f;
+}
+
+/*
+ Look CONN's request up in the page cache.
+ PAGE_HIT: it was answered from the cache. PAGE_WAIT: it waits for a regeneration already under way.
+ PAGE_MISS: the caller runs the script, and hands it *FILL if set so the response is stored.
+*/
+int TigerPageLookup(Connection *conn, PageFill **fill) {
+	static __thread char key[PAGE_MAX_KEY];
+	RequestData *req = &conn->req;
+	PageRule *rule;
+	CacheEntry *entry = NULL;
+	PageFill *refill = NULL;
+	time_t t = now();
+	Page *p;
+
+	*fill = NULL;
+	if (req->verb != VERB_GET && req->verb != VERB_HEAD) return PAGE_MISS;
+	if (!(rule = findrule(req->truepath)) || !makekey(conn, rule, key)) return PAGE_MISS;
+
+	pthread_mutex_lock(&page_lock);
+
+	p = lookup(key);
+	if (p && p->pass && t < p->fresh) {
+		pthread_mutex_unlock(&page_lock);
+		return PAGE_MISS;
+	}
+
+	/* Fresh, or stale enough to serve while one request brings it up to date */
+	if (p && p->entry && t < p->stale) {
+		entry = p->entry;
+		__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+		if (t >= p->fresh && !p->filling && req->verb == VERB_GET) refill = newfill(p, rule);
+		pthread_mutex_unlock(&page_lock);
+
+		if (refill) {
+			bool keepalive = conn->keepalive;
+			if (TigerRunPHP(conn, refill)) TigerConnDetach(conn);
+			else TigerPageEnd(refill, false);
+			conn->keepalive = keepalive;
+			conn->state = CONN_READING;
+		}
+		serve(conn, entry);
+		return PAGE_HIT;
+	}
+
+	if (p && p->filling) {
+		PageWaiter *w = calloc(1, sizeof(PageWaiter));
+		if (!w) {
+			perror("calloc()");
+			exit(1);
+		}
+		w->source = SOURCE_PAGE;
+		w->conn = conn;
+		w->worker = conn->worker;
+		w->page = p;
+		w->next = p->waiters;
+		p->waiters = w;
+		pthread_mutex_unlock(&page_lock);
+
+		conn->upstream = w;
+		conn->state = CONN_WAITING;
+		return PAGE_WAIT;
+	}
+
+	/* HEAD responses have no body to keep */
+	if (req->verb != VERB_GET) {
+		pthread_mutex_unlock(&page_lock);
+		return PAGE_MISS;
+	}
+
+	if (!p) {
+		/* Every key costs memory even without a response, so random query strings can't grow the table without end */
+		bool full = npages >= PAGE_MAX_PAGES || page_used+pagesize(key) > page_budget;
+		if (full && t != lastdrop) {
+			lastdrop = t;
+			dropexpired(t);
+			full = npages >= PAGE_MAX_PAGES || page_used+pagesize(key) > page_budget;
+		}
+		if (full) {
+			pthread_mutex_unlock(&page_lock);
+			return PAGE_MISS;
+		}
+
+		if (!(p = calloc(1, sizeof(Page))) || !(p->key = strdup(key))) {
+			perror("malloc()");
+			exit(1);
+		}
+		unsigned h = hashkey(key);
+		p->next = buckets[h];
+		buckets[h] = p;
+		page_used += pagesize(key);
+		npages++;
+	}
+	*fill = newfill(p, rule);
+
+	pthread_mutex_unlock(&page_lock);
+	return PAGE_MISS;
+}
+
+/* The response head, as extra header lines; only plain 200s the script didn't mark private are kept */
+void TigerPageHead(PageFill *f, int status, const char *extra) {
+	if (status != 200) f->failed = true;
+
+	for (const char *line = extra; line && *line; ) {
+		const char *nl = strchr(line, '\n');
+		int len = nl ? nl-line+1 : strlen(line);
+
+		if (!strncasecmp(line, "Set-Cookie:", 11)) f->pass = true;
+		if (!strncasecmp(line, "Cache-Control:", 14)) {
+			char value[256];
+			snprintf(value, sizeof value, "%.*s", len, line);
+			if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")) f->pass = true;
+		}
+		line += len;
+	}
+
+	f->headlen = snprintf(f->head, sizeof f->head, "%s", extra ? extra : "");
+	if (f->headlen >= sizeof f->head) f->failed = true;
+}
+
+void TigerPageBody(PageFill *f, const char *data, int len) {
+	if (f->failed || f->pass) return;
+
+	if (f->len+len > PAGE_MAX_BODY) {
+		f->failed = true;
+		free(f->body);
+		f->body = NULL;
+		return;
+	}
+
+	if (f->len+len > f->cap) {
+		long cap = max(f->cap*2, max(f->len+len, 4096));
+		char *body = realloc(f->body, cap);
+		if (!body) {
+			perror("realloc()");
+			exit(1);
+		}
+		f->body = body;
+		f->cap = cap;
+	}
+	memcpy(f->body+f->len, data, len);
+	f->len += len;
+}
+
+static CacheEntry *makeentry(PageFill *f) {
+	CacheEntry *e = calloc(1, sizeof(CacheEntry));
+	if (!e) {
+		perror("calloc()");
+		exit(1);
+	}
+
+	e->data = f->body ? f->body : malloc(1);
+	e->len = f->len;
+	e->heap = true;
+	e->fd = -1;
+	e->refs = 1;
+	e->headerlen = snprintf(e->header, sizeof e->header,
+		"HTTP/1.1 200 OK\r\nServer: Tiger/"TIGER_VERS"\r\nContent-Length: %ld\r\n%s", e->len, f->head);
+	f->body = NULL;
+
+	if (e->headerlen >= sizeof e->header) {
+		TigerCacheRelease(e);
+		return NULL;
+	}
+	return e;
+}
+
+/* The response F was copying is over; COMPLETE if it went through without errors. Wakes whoever was waiting for it */
+void TigerPageEnd(PageFill *f, bool complete) {
+	CacheEntry *entry = NULL, *old = NULL;
+	time_t t = now();
+	PageWaiter *w, *next;
+
+	if (!f) return;
+	Page *p = f->page;
+	if (complete && !f->failed && !f->pass) entry = makeentry(f);
+
+	pthread_mutex_lock(&page_lock);
+
+	p->filling = false;
+
+	if (entry && page_used+entry->len > page_budget) dropexpired(t);
+	if (entry && page_used+entry->len > page_budget) {
+		TigerCacheRelease(entry);
+		entry = NULL;
+	}
+
+	if (entry) {
+		old = p->entry;
+		if (old) page_used -= old->len;
+		page_used += entry->len;
+		p->entry = entry;
+		p->pass = false;
+		p->fresh = t+f->rule->ttl;
+		p->stale = p->fresh+f->rule->stale;
+	} else if (complete && f->pass) {
+		old = p->entry;
+		if (old) page_used -= old->len;
+		p->entry = NULL;
+		p->pass = true;
+		p->fresh = p->stale = t+f->rule->ttl;
+	} else if (!p->entry) {
+		//Nothing to keep and nothing older to serve: briefly passed through, then dropped like any expired page
+		p->pass = true;
+		p->fresh = p->stale = t+PAGE_FAIL_TTL;
+	}
+
+	/* Waiters are answered by their own workers */
+	for (w = p->waiters; w; w = next) {
+		next = w->next;
+		w->page = NULL;
+		if ((w->entry = p->entry)) __atomic_add_fetch(&w->entry->refs, 1, __ATOMIC_RELAXED);
+		w->next = w->worker->woken;
+		w->worker->woken = w;
+		eventfd_write(w->worker->wakefd, 1);
+	}
+	p->waiters = NULL;
+
+	pthread_mutex_unlock(&page_lock);
+
+	TigerCacheRelease(old);
+	free(f->body);
+	free(f);
+}
+
+/* Answer the requests whose pages came in, run on the worker they belong to */
+void TigerPageWake(Worker *worker) {
+	eventfd_t n;
+	PageWaiter *w, *next;
+
+	eventfd_read(worker->wakefd, &n);
+
+	pthread_mutex_lock(&page_lock);
+	w = worker->woken;
+	worker->woken = NULL;
+	pthread_mutex_unlock(&page_lock);
+
+	for (; w; w = next) {
+		Connection *conn = w->conn;
+		next = w->next;
+
+		if (conn) {
+			conn->upstream = NULL;
+			if (w->entry) {
+				serve(conn, w->entry);
+				TigerConnFinish(conn);
+			} else if (!TigerRunPHP(conn, NULL)) {
+				//Nothing usable came back, so it gets a try of its own
+				TigerErrorHandler(502, conn, rootpath);
+				TigerConnFinish(conn);
+			}
+		} else {
+			TigerCacheRelease(w->entry);
+		}
+		free(w);
+	}
+}
+
+/* The client went away while waiting */
+void TigerPageDetach(PageWaiter *w) {
+	pthread_mutex_lock(&page_lock);
+
+	if (w->page) {
+		PageWaiter **pp = &w->page->waiters;
+		while (*pp != w) pp = &(*pp)->next;
+		*pp = w->next;
+		free(w);
+	} else {
+		//Already woken, TigerPageWake() frees it
+		w->conn = NULL;
+	}
+
+	pthread_mutex_unlock(&page_lock);
+}
+
+/* Forget every page, e.g. because a script changed; pages being regenerated can only be made to wait for that */
+void TigerPagePurge() {
+	pthread_mutex_lock(&page_lock);
+
+	dropexpired(LONG_MAX);
+	for (int i=0; i<PAGE_BUCKETS; i++) {
+		for (Page *p = buckets[i]; p; p = p->next) p->fresh = p->stale = 0;
+	}
+
+	pthread_mutex_unlock(&page_lock);
+}
@@ -0,0 +1,283 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include "server.h"
+#include "librsl.h"
+
+const char *verbs[] = {"GET","POST","PUT","PATCH","DELETE","HEAD","OPTIONS"};
+
+static const char *knownheaders[HDR_COUNT] = {
+	[HDR_HOST]="Host",
+	[HDR_CONNECTION]="Connection",
+	[HDR_CONTENT_LENGTH]="Content-Length",
+	[HDR_CONTENT_TYPE]="Content-Type",
+	[HDR_TRANSFER_ENCODING]="Transfer-Encoding",
+	[HDR_IF_NONE_MATCH]="If-None-Match",
+	[HDR_IF_MODIFIED_SINCE]="If-Modified-Since",
+	[HDR_RANGE]="Range",
+	[HDR_IF_RANGE]="If-Range",
+	[HDR_ACCEPT_ENCODING]="Accept-Encoding",
+	[HDR_COOKIE]="Cookie",
+	[HDR_REFERER]="Referer",
+	[HDR_USER_AGENT]="User-Agent",
+};
+
+enum {
+	STATE_REQLINE,
+	STATE_HEADERS,
+	STATE_BODY
+};
+
+static bool sliceis(const char *buf, Slice s, const char *str) {
+	return s.len == strlen(str) && !strncasecmp(buf+s.off, str, s.len);
+}
+
+/* Does the comma-separated list in S contain TOKEN? */
+static bool hastoken(const char *buf, Slice s, const char *token) {
+	int tlen = strlen(token);
+	const char *p = buf+s.off;
+	const char *end = p+s.len;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+		const char *t = p;
+		while (p < end && *p != ',') p++;
+		const char *e = p;
+		while (e > t && (e[-1] == ' ' || e[-1] == '\t')) e--;
+		if (e-t == tlen && !strncasecmp(t, token, tlen)) return true;
+	}
+	return false;
+}
+
+/* Well-known names are told apart by length and first letter, then confirmed with a single compare */
+static int knownheader(const char *buf, Slice name) {
+	char c = buf[name.off] | 0x20;
+	int h;
+
+	switch (name.len) {
+		case 4: h = HDR_HOST; break;
+		case 5: h = HDR_RANGE; break;
+		case 6: h = HDR_COOKIE; break;
+		case 7: h = HDR_REFERER; break;
+		case 8: h = HDR_IF_RANGE; break;
+		case 10: h = c == 'c' ? HDR_CONNECTION : HDR_USER_AGENT; break;
+		case 12: h = HDR_CONTENT_TYPE; break;
+		case 13: h = HDR_IF_NONE_MATCH; break;
+		case 14: h = HDR_CONTENT_LENGTH; break;
+		case 15: h = HDR_ACCEPT_ENCODING; break;
+		case 17: h = c == 't' ? HDR_TRANSFER_ENCODING : HDR_IF_MODIFIED_SINCE; break;
+		default: return -1;
+	}
+
+	return sliceis(buf, name, knownheaders[h]) ? h : -1;
+}
+
+static int fail(RequestData *req, int status) {
+	req->error = status;
+	return PARSE_ERROR;
+}
+
+static int parsereqline(RequestData *req, const char *buf, int start, int end) {
+	int p = start;
+	Slice parts[3];
+	int n = 0;
+
+	/* Split on runs of spaces */
+	while (p < end && n < 3) {
+		while (p < end && buf[p] == ' ') p++;
+		if (p == end) break;
+		parts[n].off = p;
+		while (p < end && buf[p] != ' ') p++;
+		parts[n].len = p-parts[n].off;
+		n++;
+	}
+	while (p < end && buf[p] == ' ') p++;
+
+	if (n == 2) return fail(req, PARSE_HTTP09);
+	if (n != 3 || p != end) return fail(req, 400);
+
+	req->rverb = parts[0];
+	req->target = parts[1];
+	req->protocol = parts[2];
+
+	/* Split the target into path and query */
+	const char *q = memchr(buf+req->target.off, '?', req->target.len);
+	req->path.off = req->target.off;
+	req->path.len = q ? q-(buf+req->target.off) : req->target.len;
+	req->query.off = q ? q-buf+1 : req->target.off+req->target.len;
+	req->query.len = req->target.off+req->target.len-req->query.off;
+
+	if (sliceis(buf, req->protocol, "HTTP/1.1")) req->minor = 1;
+	else if (sliceis(buf, req->protocol, "HTTP/1.0")) req->minor = 0;
+	else return fail(req, 505);
+
+	req->verb = -1;
+	for (int i=0; i<sizeof(verbs)/sizeof(verbs[0]); i++) {
+		if (req->rverb.len == strlen(verbs[i]) && !memcmp(buf+req->rverb.off, verbs[i], req->rverb.len)) {
+			req->verb = i;
+			break;
+		}
+	}
+	if (req->verb < 0) return fail(req, 501);
+
+	if (buf[req->path.off] != '/') return fail(req, 400);
+
+	return PARSE_AGAIN;
+}
+
+static int parseheader(RequestData *req, const char *buf, int start, int end, int colon) {
+	Slice name, value;
+
+	/* No folded lines, no whitespace before the colon */
+	if (colon < 0 || colon == start || buf[start] == ' ' || buf[start] == '\t' || buf[colon-1] == ' ') return fail(req, 400);
+
+	name.off = start;
+	name.len = colon-start;
+
+	value.off = colon+1;
+	while (value.off < end && (buf[value.off] == ' ' || buf[value.off] == '\t')) value.off++;
+	int vend = end;
+	while (vend > value.off && (buf[vend-1] == ' ' || buf[vend-1] == '\t')) vend--;
+	value.len = vend-value.off;
+
+	if (req->nheaders == MAX_HEADERS) return fail(req, 431);
+	req->headers[req->nheaders].name = name;
+	req->headers[req->nheaders].value = value;
+	req->nheaders++;
+
+	int h = knownheader(buf, name);
+	if (h < 0) return PARSE_AGAIN;
+
+	/* Repeats of a well-known header are kept in the table, but lookups see the first one */
+	if (req->known[h]) {
+		if (h == HDR_HOST || h == HDR_CONTENT_LENGTH) return fail(req, 400);
+		return PARSE_AGAIN;
+	}
+	req->known[h] = req->nheaders;
+
+	switch (h) {
+		case HDR_CONTENT_LENGTH: {
+			long n = 0;
+			if (!value.len) return fail(req, 400);
+			for (int i=0; i<value.len; i++) {
+				char c = buf[value.off+i];
+				if (c < '0' || c > '9' || n > BUFSIZ) return fail(req, c < '0' || c > '9' ? 400 : 413);
+				n = n*10 + c-'0';
+			}
+			req->contentlen = n;
+			break;
+		}
+		case HDR_TRANSFER_ENCODING:
+			return fail(req, 501);
+		case HDR_CONNECTION:
+			if (hastoken(buf, value, "close")) req->connection = CONN_HDR_CLOSE;
+			else if (hastoken(buf, value, "keep-alive")) req->connection = CONN_HDR_KEEPALIVE;
+			break;
+	}
+
+	return PARSE_AGAIN;
+}
+
+void TigerResetRequest(RequestData *req) {
+	memset(req, 0, offsetof(RequestData, headers));
+	req->contentlen = -1;
+}
+
+/* Parse the request at the start of BUF; it can be called again with more data after PARSE_AGAIN and picks up where it stopped */
+int TigerParseRequest(RequestData *req, const char *buf, int len) {
+	while (req->state != STATE_BODY) {
+		int colon = -1;
+		int end = TigerScanLine(buf, req->pos, len, &colon);
+		if (end < 0) return PARSE_AGAIN;
+
+		int start = req->pos;
+		req->pos = end+1;
+		if (end > start && buf[end-1] == '\r') end--;
+
+		if (req->state == STATE_REQLINE) {
+			//Ignore empty lines before the request line
+			if (end == start) continue;
+			if (parsereqline(req, buf, start, end) == PARSE_ERROR) return PARSE_ERROR;
+			req->state = STATE_HEADERS;
+		} else if (end == start) {
+			//HTTP/1.1 requires exactly one Host header
+			if (req->minor && !req->known[HDR_HOST]) return fail(req, 400);
+			req->state = STATE_BODY;
+		} else if (parseheader(req, buf, start, end, colon) == PARSE_ERROR) {
+			return PARSE_ERROR;
+		}
+	}
+
+	long bodylen = max(req->contentlen, 0);
+	if (req->pos+bodylen > BUFSIZ) return fail(req, 413);
+	if (req->pos+bodylen > len) return PARSE_AGAIN;
+
+	req->body.off = req->pos;
+	req->body.len = bodylen;
+	req->length = req->pos+bodylen;
+	return PARSE_DONE;
+}
+
+/* Value of the well-known header HDR, or NULL if the request did not have it */
+Slice *TigerHeader(RequestData *req, int hdr) {
+	return req->known[hdr] ? &req->headers[req->known[hdr]-1].value : NULL;
+}
+
+/* Value of the first header called NAME (case-insensitive), or NULL */
+Slice *TigerFindHeader(RequestData *req, const char *buf, const char *name) {
+	for (int i=0; i<req->nheaders; i++) {
+		if (sliceis(buf, req->headers[i].name, name)) return &req->headers[i].value;
+	}
+	return NULL;
+}
+
+static int hexval(char c) {
+	if (c >= '0' && c <= '9') return c-'0';
+	if (c >= 'a' && c <= 'f') return c-'a'+10;
+	if (c >= 'A' && c <= 'F') return c-'A'+10;
+	return -1;
+}
+
+/* Copy the percent-decoded, normalized path into TRUEPATH */
+bool TigerDecodePath(RequestData *req, const char *buf) {
+	const char *p = buf+req->path.off;
+	int o = 0;
+
+	for (int i=0; i<req->path.len; i++) {
+		char c = p[i];
+
+		if (c == '%') {
+			if (i+2 >= req->path.len || hexval(p[i+1]) < 0 || hexval(p[i+2]) < 0) return false;
+			c = hexval(p[i+1])*16 + hexval(p[i+2]);
+			if (!c) return false;
+			i += 2;
+		}
+
+		if (o >= sizeof(req->truepath)-1) return false;
+		req->truepath[o++] = c;
+	}
+
+	req->truepath[o] = 0;
+	normpath(req->truepath);
+	return true;
+}
@@ -0,0 +1,286 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ Route index: every pattern is compiled into a path through one trie whose edges are pattern tokens.
+ Literal bytes are looked up by value, and wildcards (?, [...] and *) are edges of their own, shared
+ by the patterns that have them in the same place. A lookup follows the literal edges and only
+ branches at the wildcards it meets, so its cost depends on the path, not on how many routes there
+ are. Matching follows fnmatch() with no flags.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+#include "server.h"
+
+enum {
+	TOK_CHAR,
+	TOK_ANY, //?
+	TOK_STAR, //*
+	TOK_SET //[...]
+};
+
+typedef struct {
+	unsigned char type; //Token on the edge leading here
+	unsigned char c;
+	int set; //Index into the index's sets, for TOK_SET
+	int child; //First literal child, sorted by C
+	int wild; //First wildcard child
+	int sibling;
+	int end; //Order of the first route ending here, INT_MAX if none
+	int value;
+	int minorder; //Smallest order in the subtree, anything worse is never visited
+} RouteNode;
+
+typedef struct {
+	unsigned char bits[32]; //Bytes a bracket expression accepts
+} RouteSet;
+
+struct RouteIndex {
+	RouteNode *nodes;
+	int nnodes, capnodes;
+	RouteSet *sets;
+	int nsets, capsets;
+	int nroutes;
+};
+
+static void *grow(void *p, int *cap, int need, size_t size) {
+	if (need <= *cap) return p;
+	*cap = need > *cap*2 ? need : *cap*2;
+	if (!(p = realloc(p, *cap*size))) {
+		perror("realloc()");
+		exit(1);
+	}
+	return p;
+}
+
+static int newnode(RouteIndex *idx, int type, unsigned char c, int set) {
+	idx->nodes = grow(idx->nodes, &idx->capnodes, idx->nnodes+1, sizeof(RouteNode));
+	idx->nodes[idx->nnodes] = (RouteNode){type, c, set, -1, -1, -1, INT_MAX, -1, INT_MAX};
+	return idx->nnodes++;
+}
+
+RouteIndex *TigerRouteNew() {
+	RouteIndex *idx = calloc(1, sizeof(RouteIndex));
+	if (!idx) {
+		perror("calloc()");
+		exit(1);
+	}
+	newnode(idx, TOK_CHAR, 0, -1);
+	return idx;
+}
+
+void TigerRouteFree(RouteIndex *idx) {
+	if (!idx) return;
+	free(idx->nodes);
+	free(idx->sets);
+	free(idx);
+}
+
+/* Named classes inside brackets, e.g. [[:digit:]] */
+static const struct {
+	const char *name;
+	int (*is)(int);
+} classes[] = {
+	{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+	{"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+	{"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}
+};
+
+/* Compile the bracket expression at P into SET; returns the length used, or 0 if it isn't one and '[' is literal */
+static int compileset(const char *p, RouteSet *set) {
+	const char *q = p+1;
+	bool negate = false;
+
+	memset(set, 0, sizeof *set);
+
+	if (*q == '!' || *q == '^') {
+		negate = true;
+		q++;
+	}
+
+	for (bool first = true; first || *q != ']'; first = false) {
+		unsigned char lo, hi;
+
+		if (!*q) return 0;
+
+		if (q[0] == '[' && q[1] == ':') {
+			const char *end = strstr(q+2, ":]");
+			int i;
+			if (!end) return 0;
+			for (i=0; i<sizeof(classes)/sizeof(classes[0]); i++) {
+				if (strlen(classes[i].name) == end-q-2 && !strncmp(classes[i].name, q+2, end-q-2)) break;
+			}
+			if (i == sizeof(classes)/sizeof(classes[0])) return 0;
+			for (int c=1; c<256; c++) {
+				if (classes[i].is(c)) set->bits[c/8] |= 1 << c%8;
+			}
+			q = end+2;
+			continue;
+		}
+
+		if (*q == '\\' && q[1]) q++;
+		lo = hi = *q++;
+		if (q[0] == '-' && q[1] && q[1] != ']') {
+			q++;
+			if (*q == '\\' && q[1]) q++;
+			hi = *q++;
+		}
+		for (int c=lo; c<=hi; c++) set->bits[c/8] |= 1 << c%8;
+	}
+
+	if (negate) {
+		for (int i=0; i<32; i++) set->bits[i] = ~set->bits[i];
+		set->bits[0] &= ~1; //Never the terminator
+	}
+	return q+1-p;
+}
+
+static int literalchild(RouteIndex *idx, int node, unsigned char c, bool create) {
+	int prev = -1, cur = idx->nodes[node].child;
+
+	while (cur >= 0 && idx->nodes[cur].c < c) {
+		prev = cur;
+		cur = idx->nodes[cur].sibling;
+	}
+	if (cur >= 0 && idx->nodes[cur].c == c) return cur;
+	if (!create) return -1;
+
+	int n = newnode(idx, TOK_CHAR, c, -1);
+	idx->nodes[n].sibling = cur;
+	if (prev < 0) idx->nodes[node].child = n;
+	else idx->nodes[prev].sibling = n;
+	return n;
+}
+
+/* The child of NODE along a wildcard edge, shared with any pattern that has the same wildcard there */
+static int wildchild(RouteIndex *idx, int node, int type, RouteSet *set) {
+	int *link = &idx->nodes[node].wild;
+
+	for (; *link >= 0; link = &idx->nodes[*link].sibling) {
+		RouteNode *w = &idx->nodes[*link];
+		if (w->type == type && (type != TOK_SET || !memcmp(&idx->sets[w->set], set, sizeof *set))) return *link;
+	}
+
+	int s = -1;
+	if (type == TOK_SET) {
+		idx->sets = grow(idx->sets, &idx->capsets, idx->nsets+1, sizeof(RouteSet));
+		idx->sets[s = idx->nsets++] = *set;
+	}
+
+	//New wildcards go last, LINK may have moved with the nodes
+	int n = newnode(idx, type, 0, s);
+	link = &idx->nodes[node].wild;
+	while (*link >= 0) link = &idx->nodes[*link].sibling;
+	*link = n;
+	return n;
+}
+
+/* Add PATTERN, answering VALUE; when several routes match, the one added first wins */
+void TigerRouteAdd(RouteIndex *idx, const char *pattern, int value) {
+	int order = idx->nroutes++;
+	int node = 0;
+	const char *p = pattern;
+	RouteSet set;
+	int used;
+
+	idx->nodes[0].minorder = min(idx->nodes[0].minorder, order);
+
+	while (*p) {
+		if (*p == '*') {
+			//Runs of stars are one star
+			if (idx->nodes[node].type != TOK_STAR) node = wildchild(idx, node, TOK_STAR, NULL);
+			p++;
+		} else if (*p == '?') {
+			node = wildchild(idx, node, TOK_ANY, NULL);
+			p++;
+		} else if (*p == '[' && (used = compileset(p, &set))) {
+			node = wildchild(idx, node, TOK_SET, &set);
+			p += used;
+		} else {
+			if (*p == '\\' && p[1]) p++;
+			node = literalchild(idx, node, *p++, true);
+		}
+		idx->nodes[node].minorder = min(idx->nodes[node].minorder, order);
+	}
+
+	if (idx->nodes[node].end == INT_MAX) {
+		idx->nodes[node].end = order;
+		idx->nodes[node].value = value;
+	}
+}
+
+static void walk(RouteIndex *idx, int node, const char *s, int *best, int *value);
+
+/* Match S against what hangs off NODE, whose own token has been matched */
+static void rest(RouteIndex *idx, int node, const char *s, int *best, int *value) {
+	while (node >= 0 && idx->nodes[node].minorder < *best) {
+		RouteNode *n = &idx->nodes[node];
+
+		for (int w = n->wild; w >= 0; w = idx->nodes[w].sibling) {
+			RouteNode *wn = &idx->nodes[w];
+			if (wn->type == TOK_STAR) walk(idx, w, s, best, value);
+			else if (*s && (wn->type == TOK_ANY || (idx->sets[wn->set].bits[(unsigned char)*s/8] >> (unsigned char)*s%8 & 1))) walk(idx, w, s+1, best, value);
+		}
+
+		if (!*s) {
+			if (n->end < *best) {
+				*best = n->end;
+				*value = n->value;
+			}
+			return;
+		}
+
+		//Literal runs are followed without recursing
+		node = literalchild(idx, node, *s++, false);
+	}
+}
+
+/* Match S against NODE, entered over its edge */
+static void walk(RouteIndex *idx, int node, const char *s, int *best, int *value) {
+	RouteNode *n = &idx->nodes[node];
+
+	if (n->minorder >= *best) return;
+	if (n->type != TOK_STAR) {
+		rest(idx, node, s, best, value);
+		return;
+	}
+
+	//A star that ends a pattern takes whatever is left
+	if (n->end < *best) {
+		*best = n->end;
+		*value = n->value;
+	}
+
+	for (;; s++) {
+		rest(idx, node, s, best, value);
+		if (!*s) break;
+	}
+}
+
+/* Value of the first route matching PATH, or -1 */
+int TigerRouteMatch(RouteIndex *idx, const char *path) {
+	int best = INT_MAX, value = -1;
+
+	rest(idx, 0, path, &best, &value);
+	return value;
+}
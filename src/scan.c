@@ -0,0 +1,129 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Line scanning for the request parser: finds the end of a line and its first ':' in one pass */
+
+#include <string.h>
+#include <stdbool.h>
+#include "server.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Finish a line byte by byte from POS */
+static int scanline_scalar(const char *buf, int pos, int len, int *colon) {
+	int c = *colon;
+	for (; pos < len; pos++) {
+		if (buf[pos] == '\n') {
+			*colon = c;
+			return pos;
+		}
+		if (buf[pos] == ':' && c < 0) c = pos;
+	}
+	*colon = c;
+	return -1;
+}
+
+#ifdef SCAN_X86
+/* NL and CO are bitmasks of newlines and colons in a block starting at POS; inlined into the kernels at any -O, like the intrinsics */
+__attribute__((always_inline))
+static inline bool scanblock(unsigned nl, unsigned co, int pos, int *colon, int *end) {
+	/* Only colons before the first newline count */
+	if (nl) co &= (nl & -nl)-1;
+	if (co && *colon < 0) *colon = pos+__builtin_ctz(co);
+	if (!nl) return false;
+	*end = pos+__builtin_ctz(nl);
+	return true;
+}
+
+__attribute__((target("sse2")))
+static int scanline_sse2(const char *buf, int pos, int len, int *colon) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i co = _mm_set1_epi8(':');
+	int end;
+
+	for (; pos+16 <= len; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf+pos));
+		if (scanblock(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)), _mm_movemask_epi8(_mm_cmpeq_epi8(v, co)), pos, colon, &end)) return end;
+	}
+	return scanline_scalar(buf, pos, len, colon);
+}
+
+__attribute__((target("avx2")))
+static int scanline_avx2(const char *buf, int pos, int len, int *colon) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i co = _mm256_set1_epi8(':');
+	int end;
+
+	for (; pos+32 <= len; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf+pos));
+		if (scanblock(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)), _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, co)), pos, colon, &end)) return end;
+	}
+	return scanline_scalar(buf, pos, len, colon);
+}
+#endif
+
+static const struct {
+	const char *name;
+	int (*fn)(const char *buf, int pos, int len, int *colon);
+} kernels[] = {
+#ifdef SCAN_X86
+	{"avx2", scanline_avx2},
+	{"sse2", scanline_sse2},
+#endif
+	{"scalar", scanline_scalar},
+};
+
+static int (*scanline)(const char *buf, int pos, int len, int *colon) = scanline_scalar;
+const char *scan_kernel = "scalar";
+
+static bool supported(const char *name) {
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx2")) return __builtin_cpu_supports("avx2");
+	if (!strcmp(name, "sse2")) return __builtin_cpu_supports("sse2");
+#endif
+	return !strcmp(name, "scalar");
+}
+
+/* Use the kernel called NAME, or the fastest one the CPU has if NAME is NULL */
+bool TigerScanSelect(const char *name) {
+	for (int i=0; i<sizeof(kernels)/sizeof(kernels[0]); i++) {
+		if ((!name || !strcmp(name, kernels[i].name)) && supported(kernels[i].name)) {
+			scanline = kernels[i].fn;
+			scan_kernel = kernels[i].name;
+			return true;
+		}
+	}
+	return false;
+}
+
+__attribute__((constructor))
+static void scaninit() {
+	TigerScanSelect(NULL);
+}
+
+/*
+ Returns the offset of the next '\n' at or after POS, or -1 if the buffer ends first.
+ *COLON must be -1 on entry; it gets the offset of the first ':' before that '\n'.
+*/
+int TigerScanLine(const char *buf, int pos, int len, int *colon) {
+	return scanline(buf, pos, len, colon);
+}
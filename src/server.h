@@ -17,6 +17,13 @@
 */
 
 #pragma once
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "bns.h"
 
 /* Tiger Version String */
@@ -25,25 +32,120 @@
 #define max(a,b) ((a)>(b)?(a):(b))
 #define min(a,b) ((b)>(a)?(a):(b))
 
+/* Part of the receive buffer */
 typedef struct {
-	char protocol[8];
-	char rverb[8];
-	char path[4096];
-	char *truepath;
-
-	struct {
-		char key[32];
-		char value[32];
-	} headers[64];
-	char *body;
-	
+	int off;
+	int len;
+} Slice;
+
+enum {
+	PARSE_AGAIN,
+	PARSE_DONE,
+	PARSE_ERROR
+};
+
+#define PARSE_HTTP09 9 //Error for requests without a protocol; they get no response at all
+
+/* Well-known headers, found in O(1) through RequestData.known */
+enum {
+	HDR_HOST,
+	HDR_CONNECTION,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_TYPE,
+	HDR_TRANSFER_ENCODING,
+	HDR_IF_NONE_MATCH,
+	HDR_IF_MODIFIED_SINCE,
+	HDR_RANGE,
+	HDR_IF_RANGE,
+	HDR_ACCEPT_ENCODING,
+	HDR_COOKIE,
+	HDR_REFERER,
+	HDR_USER_AGENT,
+	HDR_COUNT
+};
+
+#define MAX_HEADERS 64
+
+typedef struct {
+	Slice name;
+	Slice value; //Without surrounding whitespace
+} Header;
+
+enum {
+	CONN_HDR_NONE,
+	CONN_HDR_CLOSE,
+	CONN_HDR_KEEPALIVE
+};
+
+/* A parsed request; everything but TRUEPATH points into the connection's receive buffer */
+typedef struct {
+	Slice rverb;
+	Slice target; //Path and query
+	Slice path;
+	Slice query;
+	Slice protocol;
+	Slice body;
 	int verb;
+	int minor; //HTTP/1.MINOR
+
+	long contentlen;
+	int connection;
+
+	int length; //Bytes taken by the whole request
+	int error; //HTTP status to answer with after PARSE_ERROR
+
+	int state; //Parser state, so parsing can resume when more data arrives
+	int pos;
+
+	int nheaders;
+	unsigned char known[HDR_COUNT]; //1 + index in HEADERS of each well-known header, 0 if absent
+
+	/* Not cleared between requests */
+	Header headers[MAX_HEADERS];
+	char truepath[4096]; //Decoded, normalized path
 } RequestData;
 
+/* Content codings, in order of preference */
+enum {
+	ENC_NONE,
+	ENC_BR,
+	ENC_GZIP,
+	ENC_COUNT
+};
+
+/* Immutable file contents shared between requests */
+typedef struct CacheEntry {
+	char *path; //Relative to public/
+	char *data; //File read into memory, NULL for large files, which are sent straight from FD
+	int fd;
+	long len;
+	bool heap; //DATA was malloc()ed, it isn't the empty string
+
+	int encoding;
+	struct CacheEntry *variants[ENC_COUNT]; //Compressed copies, each holding a reference
+	unsigned char tried; //Bitmask of encodings already looked for
+
+	char header[512]; //Ready-to-send 200 response header, without Connection and the final CRLF
+	int headerlen;
+	char etag[48];
+	char lastmod[32];
+	int refs;
+
+	time_t mtime;
+	ino_t ino;
+	time_t validated;
+
+	bool cached;
+	bool referenced; //CLOCK bit
+	struct CacheEntry *hnext; //Hash chain
+	struct CacheEntry *cprev, *cnext; //CLOCK ring
+} CacheEntry;
+
 typedef struct {
 	int type; //0 = invalid, 1 = cached file, 2 = public file
 	int datalen;
 	char *data;
+	CacheEntry *entry; //Owns DATA when set
 } loadFile_returnData;
 
 typedef enum {
@@ -55,3 +157,197 @@ typedef enum {
 	VERB_HEAD,
 	VERB_OPTIONS
 } HTTPVerb;
+
+typedef enum {
+	CONN_READING,
+	CONN_WRITING,
+	CONN_WAITING, //Response comes from an upstream such as PHP
+	CONN_CLOSING
+} ConnState;
+
+/* First member of everything registered with a worker's epoll set, except the listener */
+enum {
+	SOURCE_CLIENT,
+	SOURCE_FASTCGI,
+	SOURCE_PIPE,
+	SOURCE_PAGE, //Waiting on a page cache regeneration, never in the epoll set itself
+	SOURCE_WAKE
+};
+
+/* TigerPageLookup() results */
+enum {
+	PAGE_MISS,
+	PAGE_HIT,
+	PAGE_WAIT
+};
+
+#define MAX_PENDING 65536 //Response bytes a connection may have queued before its producer is held back
+
+/* Part of a queued response: bytes in the connection's own buffer, memory owned by a cache entry, or a slice of its file */
+typedef struct {
+	CacheEntry *entry;
+	const char *data; //NULL for resbuff and file segments
+	long off; //Offset into DATA, the file, or resbuff
+	long len;
+} OutSegment;
+
+#define MAX_SEGMENTS 64
+
+typedef struct Connection {
+	int source; //SOURCE_CLIENT
+	int sock;
+	ConnState state;
+	struct sockaddr_in addr;
+
+	char reqbuff[BUFSIZ+1];
+	int reqlen;
+	RequestData req;
+
+	char *resbuff; //Pending response bytes
+	int reslen;
+	int rescap;
+
+	OutSegment out[MAX_SEGMENTS];
+	int nout;
+	int outhead; //First segment not fully written
+	long outoff; //Bytes of OUT[OUTHEAD] already written
+
+	int nrequests;
+	int status; //Of the current response, for the access log
+	long bodylen;
+	long accepted, parsens, phpstart, sendstart; //Stage timing, see TigerStatsClock()
+	bool keepalive; //Keep the connection open after the current response
+	bool headonly; //Current request is HEAD, don't send the body
+	bool eof;
+	bool unread; //Last read stopped at a full buffer, the socket may hold more
+	time_t lastactive;
+	void *upstream; //What a CONN_WAITING connection waits for, starting with its SOURCE_ tag
+	int waitlen; //Length of the request the upstream answers, left in REQBUFF until then
+
+	struct Worker *worker;
+	struct Connection *next; //Free list link
+	struct Connection *idleprev, *idlenext; //Worker idle list, least recently active first
+} Connection;
+
+struct FcgiUpstream;
+struct FcgiRequest;
+struct SpawnRequest;
+struct PageFill;
+struct PageWaiter;
+typedef struct RouteIndex RouteIndex;
+typedef struct LogRing LogRing;
+typedef struct Stats Stats;
+
+/* Request stages timed by the statistics */
+enum {
+	STAGE_ACCEPT, //From accepting a connection to its first complete request
+	STAGE_PARSE,
+	STAGE_LOAD, //Handling the request up to its response being queued, or handed to PHP
+	STAGE_PHP, //Waiting for PHP to answer
+	STAGE_SEND, //From the response being ready to its last byte being written
+	STAGE_COUNT
+};
+
+/* Access log formats */
+enum {
+	LOG_OFF,
+	LOG_COMMON,
+	LOG_COMBINED,
+	LOG_JSON
+};
+
+typedef struct Worker {
+	int id;
+	int serversock;
+	int epfd;
+	pthread_t thread;
+	Connection *freeconns;
+	Connection *idlehead, *idletail;
+	time_t now;
+	struct FcgiUpstream *fcgipool; //FastCGI connections
+	struct FcgiUpstream *fcgidead; //Broken during the current event batch
+	struct SpawnRequest *spawndone; //Finished children not yet reaped
+	int wakefd; //Signalled when other workers hand back page cache waiters
+	struct PageWaiter *woken; //Waiters ready to be answered, under the page cache lock
+	unsigned long epoch; //Odd while waiting for events, when the worker holds nothing from the script table, see TigerWorkersSync()
+	int nconns; //Open client connections, watched while draining
+	LogRing *log; //Access log lines waiting to be written
+	Stats *stats;
+} Worker;
+
+int TigerInit(unsigned short port, bool reuseport);
+void TigerStartWorkers(unsigned short port, int nworkers, bool pin);
+void TigerWorkersSync();
+void TigerEventLoop(Worker *worker);
+void TigerHandleRequest(Connection *conn);
+void TigerConnWrite(Connection *conn, const char *data, int len);
+void TigerConnHeader(Connection *conn, int status, long contentlen, const char *extra);
+void TigerConnBody(Connection *conn, const char *data, int len);
+void TigerConnBodyEntry(Connection *conn, CacheEntry *entry, long off, long len);
+void TigerConnHeaderEntry(Connection *conn, CacheEntry *entry);
+bool TigerConnFlush(Connection *conn);
+void TigerConnFinish(Connection *conn);
+void TigerConnDetach(Connection *conn);
+void TigerBuildHeader(CacheEntry *entry);
+bool TigerNotModified(Connection *conn, CacheEntry *entry);
+void TigerConnNotModified(Connection *conn, CacheEntry *entry);
+bool TigerConnRange(Connection *conn, CacheEntry *entry);
+const char *TigerMimeType(const char *path);
+void TigerErrorHandler(int status, Connection *conn, char *rootpath);
+void TigerResetRequest(RequestData *req);
+int TigerParseRequest(RequestData *req, const char *buf, int len);
+bool TigerDecodePath(RequestData *req, const char *buf);
+Slice *TigerHeader(RequestData *req, int hdr);
+Slice *TigerFindHeader(RequestData *req, const char *buf, const char *name);
+int TigerScanLine(const char *buf, int pos, int len, int *colon);
+bool TigerScanSelect(const char *name);
+
+CacheEntry *TigerCacheGet(const char *path, bool *hit);
+void TigerCacheRelease(CacheEntry *entry);
+CacheEntry *TigerCacheVariant(CacheEntry *entry, int accepted);
+void TigerCacheInvalidate(const char *path, bool tree);
+bool TigerFcgiStart(Connection *conn, struct PageFill *fill);
+void TigerFcgiEvent(void *source, uint32_t events);
+void TigerFcgiResume(struct FcgiRequest *req);
+void TigerFcgiDetach(struct FcgiRequest *req);
+void TigerFcgiReap(Worker *worker);
+void TigerFcgiSpawn(int children);
+bool TigerSpawnStart(Connection *conn, char **argv, struct PageFill *fill);
+void TigerSpawnEvent(void *source, uint32_t events);
+void TigerSpawnResume(struct SpawnRequest *req);
+void TigerSpawnDetach(struct SpawnRequest *req);
+void TigerSpawnReap(Worker *worker);
+bool TigerRunPHP(Connection *conn, struct PageFill *fill);
+void TigerPageRules(const char *path);
+int TigerPageLookup(Connection *conn, struct PageFill **fill);
+void TigerPageHead(struct PageFill *fill, int status, const char *extra);
+void TigerPageBody(struct PageFill *fill, const char *data, int len);
+void TigerPageEnd(struct PageFill *fill, bool complete);
+void TigerPageWake(Worker *worker);
+void TigerPageDetach(struct PageWaiter *waiter);
+void TigerPagePurge();
+RouteIndex *TigerRouteNew();
+void TigerRouteFree(RouteIndex *idx);
+void TigerRouteAdd(RouteIndex *idx, const char *pattern, int value);
+int TigerRouteMatch(RouteIndex *idx, const char *path);
+bool TigerCompressible(const char *type);
+int TigerAcceptEncoding(RequestData *req, const char *buf);
+char *TigerCompress(int enc, const char *data, long len, long *outlen);
+void TigerWatch();
+void TigerUpgradeInit(char **argv);
+void TigerUpgradeListen();
+bool TigerUpgrading();
+int TigerInheritListeners(int *fds, int max);
+void TigerUpgradeReady();
+LogRing *TigerLogRing();
+void TigerLogRequest(Connection *conn);
+void TigerLogFlush();
+void TigerLogStart();
+long TigerStatsClock();
+Stats *TigerStatsNew();
+void TigerStatsTime(Worker *worker, int stage, long ns);
+void TigerStatsAccept(Worker *worker);
+void TigerStatsCache(Worker *worker, bool hit);
+void TigerStatsPHP(Worker *worker);
+void TigerStatsRequest(Connection *conn);
+bool TigerStatsServe(Connection *conn);
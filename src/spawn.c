@@ -0,0 +1,243 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Child processes whose standard output is streamed to a connection as it is produced */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <stdbool.h>
+#include "server.h"
+
+#define PIPE_READ 65536
+
+extern char rootpath[];
+extern char **environ;
+
+typedef struct SpawnRequest {
+	int source; //Must come first, see TigerEventLoop()
+	int fd; //Read end of the child's stdout
+	pid_t pid;
+	Connection *conn; //NULL once the client has gone away
+	Worker *worker;
+	bool started; //Response head already sent
+	bool chunked;
+	bool paused; //Not reading until the client catches up
+	bool reading;
+	bool done;
+	struct PageFill *fill; //Copy of the output for the page cache
+	struct SpawnRequest *next; //Worker's list of finished children not yet reaped
+} SpawnRequest;
+
+static void chunk(SpawnRequest *s, const char *data, int len) {
+	char size[16];
+
+	if (s->chunked) TigerConnBody(s->conn, size, snprintf(size, sizeof size, "%x\r\n", len));
+	TigerConnBody(s->conn, data, len);
+	if (s->chunked) TigerConnBody(s->conn, "\r\n", 2);
+}
+
+/* The child is gone: a copy for the page cache is only good if it succeeded, and a request it wrote nothing for is answered now */
+static void exited(SpawnRequest *s, int status) {
+	Connection *conn = s->conn;
+	bool ok = WIFEXITED(status) && !WEXITSTATUS(status);
+
+	TigerPageEnd(s->fill, ok);
+	s->fill = NULL;
+
+	if (!conn || s->started) return;
+	conn->upstream = NULL;
+	if (!ok) TigerErrorHandler(500, conn, rootpath);
+	else TigerConnHeader(conn, 200, 0, NULL);
+	s->conn = NULL;
+	TigerConnFinish(conn);
+}
+
+static void finish(SpawnRequest *s) {
+	Connection *conn = s->conn;
+	int status = 0;
+
+	s->done = true;
+	//Explicitly, as a child being started by another worker keeps the pipe in the epoll set until its exec(), and S is freed soon
+	epoll_ctl(s->worker->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+
+	/* Usually the child is gone by the time its stdout closes; if not, TigerSpawnReap() collects it later */
+	if (waitpid(s->pid, &status, WNOHANG) == s->pid) {
+		s->pid = 0;
+		exited(s, status);
+	}
+
+	/* Without output, the response waits for the exit status */
+	if (s->conn && s->started) {
+		conn->upstream = NULL;
+		if (s->chunked) TigerConnBody(conn, "0\r\n\r\n", 5);
+		s->conn = NULL;
+		TigerConnFinish(conn);
+	}
+
+	s->next = s->worker->spawndone;
+	s->worker->spawndone = s;
+}
+
+static void readchild(SpawnRequest *s) {
+	static __thread char buf[PIPE_READ];
+
+	if (s->reading) return;
+	s->reading = true;
+
+	while (!s->paused && !s->done) {
+		int n = read(s->fd, buf, sizeof buf);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			n = 0;
+		}
+		if (n == 0) {
+			finish(s);
+			break;
+		}
+
+		if (s->fill) TigerPageBody(s->fill, buf, n);
+
+		Connection *conn = s->conn;
+		if (!conn) continue; //Nobody to send it to, drain it until the child is done
+
+		if (!s->started) {
+			TigerConnHeader(conn, 200, -1, s->chunked ? "Transfer-Encoding: chunked\r\n" : NULL);
+			s->started = true;
+		}
+		chunk(s, buf, n);
+
+		if (!TigerConnFlush(conn) && conn->reslen > MAX_PENDING) s->paused = true;
+	}
+
+	s->reading = false;
+}
+
+/* Run ARGV with its stdout streamed to CONN as the response body, and copied to FILL if set; returns false if it can't be started */
+bool TigerSpawnStart(Connection *conn, char **argv, struct PageFill *fill) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t none;
+	SpawnRequest *s;
+	int fds[2];
+	pid_t pid;
+	int err;
+
+	if (pipe2(fds, O_CLOEXEC)) return false;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	//Signals Tiger leaves to one thread are blocked everywhere else, the script gets them back
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(fds[1]);
+
+	if (err) {
+		close(fds[0]);
+		errno = err;
+		return false;
+	}
+
+	if (!(s = calloc(1, sizeof(SpawnRequest)))) {
+		perror("calloc()");
+		exit(1);
+	}
+	s->source = SOURCE_PIPE;
+	s->fd = fds[0];
+	s->pid = pid;
+	s->conn = conn;
+	s->worker = conn->worker;
+	s->fill = fill;
+
+	/* Without chunked encoding the end of the body can only be told by closing */
+	s->chunked = conn->req.minor == 1;
+	if (!s->chunked) conn->keepalive = false;
+
+	conn->upstream = s;
+	conn->state = CONN_WAITING;
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+		.data.ptr = s
+	};
+	if (fcntl(s->fd, F_SETFL, O_NONBLOCK) || epoll_ctl(conn->worker->epfd, EPOLL_CTL_ADD, s->fd, &ev)) {
+		perror("epoll_ctl()");
+		kill(pid, SIGTERM);
+		s->conn = NULL;
+		s->fill = NULL; //Still the caller's
+		conn->upstream = NULL;
+		conn->state = CONN_READING;
+		finish(s);
+		return false;
+	}
+
+	return true;
+}
+
+void TigerSpawnEvent(void *source, uint32_t events) {
+	SpawnRequest *s = source;
+	if (!s->done) readchild(s);
+}
+
+void TigerSpawnResume(struct SpawnRequest *s) {
+	if (!s->paused) return;
+	s->paused = false;
+	readchild(s);
+}
+
+/* The client went away; the child is told to stop and its remaining output is thrown away, unless it is wanted for the page cache */
+void TigerSpawnDetach(struct SpawnRequest *s) {
+	s->conn = NULL;
+	if (s->pid && !s->fill) kill(s->pid, SIGTERM);
+	TigerSpawnResume(s);
+}
+
+/* Free the finished children once they have exited, answering for those that wrote nothing */
+void TigerSpawnReap(Worker *worker) {
+	SpawnRequest **p = &worker->spawndone;
+
+	while (*p) {
+		SpawnRequest *s = *p;
+		int status = 0;
+		if (s->pid && waitpid(s->pid, &status, WNOHANG) == 0) {
+			p = &s->next;
+			continue;
+		}
+		*p = s->next;
+		if (s->pid) exited(s, status);
+		free(s);
+	}
+}
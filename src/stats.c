@@ -0,0 +1,279 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ Statistics: every worker counts into its own Stats, which only it writes, so counting takes no atomic
+ instructions and no cache line moves between CPUs. Reading them adds up every worker's, under /__tiger/.
+
+ Latencies go into log-linear histograms: four buckets per power of two nanoseconds, so any value
+ is within 25% of the bucket it is reported as, from nanoseconds to centuries in 256 counters.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "server.h"
+
+#define STATS_BUCKETS 256
+#define STATS_CODES 600
+
+typedef struct {
+	unsigned long count;
+	unsigned long sum; //Nanoseconds
+	unsigned long max;
+	unsigned long buckets[STATS_BUCKETS];
+} Histogram;
+
+struct Stats {
+	unsigned long accepted;
+	unsigned long requests;
+	unsigned long codes[STATS_CODES];
+	unsigned long cachehits, cachemisses;
+	unsigned long php;
+	time_t second; //Monotonic second THISSECOND counts requests for
+	unsigned long thissecond, lastsecond;
+	Histogram stages[STAGE_COUNT];
+};
+
+extern Worker *workers;
+extern int nworkers;
+
+bool stats_enabled = false;
+
+static const char *stages[] = {"accept", "parse", "load", "php", "send"};
+static long started;
+
+/* Only the owning worker writes, a plain increment published without a locked instruction */
+#define BUMP(x, n) __atomic_store_n(&(x), (x)+(n), __ATOMIC_RELAXED)
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* Monotonic nanoseconds */
+long TigerStatsClock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/* A worker's counters, NULL if statistics are off */
+Stats *TigerStatsNew() {
+	Stats *s;
+
+	if (!stats_enabled) return NULL;
+	if (!(s = calloc(1, sizeof(Stats)))) {
+		perror("calloc()");
+		exit(1);
+	}
+	if (!started) started = TigerStatsClock();
+	return s;
+}
+
+static int bucket(unsigned long v) {
+	if (v < 4) return v;
+	int e = 63-__builtin_clzl(v);
+	return (e-1)*4 + (v >> (e-2) & 3);
+}
+
+/* Largest value that lands in bucket I */
+static unsigned long bucketmax(int i) {
+	if (i < 4) return i;
+	int e = i/4+1;
+	return ((4UL+i%4) << (e-2)) + (1UL << (e-2)) - 1;
+}
+
+void TigerStatsTime(Worker *worker, int stage, long ns) {
+	Histogram *h;
+
+	if (!worker->stats) return;
+	h = &worker->stats->stages[stage];
+	if (ns < 0) ns = 0;
+	BUMP(h->count, 1);
+	BUMP(h->sum, ns);
+	BUMP(h->buckets[bucket(ns)], 1);
+	if ((unsigned long)ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+void TigerStatsAccept(Worker *worker) {
+	if (worker->stats) BUMP(worker->stats->accepted, 1);
+}
+
+void TigerStatsCache(Worker *worker, bool hit) {
+	if (!worker->stats) return;
+	if (hit) BUMP(worker->stats->cachehits, 1);
+	else BUMP(worker->stats->cachemisses, 1);
+}
+
+void TigerStatsPHP(Worker *worker) {
+	if (worker->stats) BUMP(worker->stats->php, 1);
+}
+
+/* Count the response CONN has just finished */
+void TigerStatsRequest(Connection *conn) {
+	Stats *s = conn->worker->stats;
+
+	if (!s) return;
+	BUMP(s->requests, 1);
+	if (conn->status > 0 && conn->status < STATS_CODES) BUMP(s->codes[conn->status], 1);
+
+	if (conn->worker->now != s->second) {
+		__atomic_store_n(&s->lastsecond, conn->worker->now == s->second+1 ? s->thissecond : 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->thissecond, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->second, conn->worker->now, __ATOMIC_RELAXED);
+	}
+	BUMP(s->thissecond, 1);
+}
+
+/* Every worker's counters added up */
+static bool collect(Stats *total, unsigned long *persecond, int *conns) {
+	Worker *all = __atomic_load_n(&workers, __ATOMIC_ACQUIRE);
+	struct timespec ts;
+
+	if (!all) return false;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	memset(total, 0, sizeof *total);
+	*persecond = 0;
+	*conns = 0;
+
+	for (int i=0; i<nworkers; i++) {
+		Stats *s = all[i].stats;
+		if (!s) continue;
+
+		*conns += __atomic_load_n(&all[i].nconns, __ATOMIC_RELAXED);
+		total->accepted += LOAD(s->accepted);
+		total->requests += LOAD(s->requests);
+		total->cachehits += LOAD(s->cachehits);
+		total->cachemisses += LOAD(s->cachemisses);
+		total->php += LOAD(s->php);
+		for (int c=0; c<STATS_CODES; c++) total->codes[c] += LOAD(s->codes[c]);
+
+		//The last full second, whichever second the worker last counted in
+		time_t second = LOAD(s->second);
+		if (second == ts.tv_sec) *persecond += LOAD(s->lastsecond);
+		else if (second == ts.tv_sec-1) *persecond += LOAD(s->thissecond);
+
+		for (int t=0; t<STAGE_COUNT; t++) {
+			Histogram *h = &s->stages[t], *th = &total->stages[t];
+			th->count += LOAD(h->count);
+			th->sum += LOAD(h->sum);
+			th->max = max(th->max, LOAD(h->max));
+			for (int b=0; b<STATS_BUCKETS; b++) th->buckets[b] += LOAD(h->buckets[b]);
+		}
+	}
+	return true;
+}
+
+/* Upper bound of the bucket holding the Q quantile, in nanoseconds */
+static unsigned long quantile(Histogram *h, double q) {
+	unsigned long rank = q*h->count, seen = 0;
+
+	for (int b=0; b<STATS_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > rank) return min(bucketmax(b), h->max);
+	}
+	return h->max;
+}
+
+static void json(FILE *f, Stats *s, unsigned long persecond, int conns) {
+	bool first = true;
+
+	fprintf(f, "{\"uptime\":%.3f,\"connections\":%d,\"accepted\":%lu,\"requests\":%lu,\"requests_per_second\":%lu,\"status\":{",
+		(TigerStatsClock()-started)/1e9, conns, s->accepted, s->requests, persecond);
+	for (int c=0; c<STATS_CODES; c++) {
+		if (!s->codes[c]) continue;
+		fprintf(f, "%s\"%d\":%lu", first ? "" : ",", c, s->codes[c]);
+		first = false;
+	}
+
+	unsigned long lookups = s->cachehits+s->cachemisses;
+	fprintf(f, "},\"cache\":{\"hits\":%lu,\"misses\":%lu,\"hit_ratio\":%.4f},\"php\":{\"requests\":%lu},\"latency_us\":{",
+		s->cachehits, s->cachemisses, lookups ? (double)s->cachehits/lookups : 0.0, s->php);
+
+	for (int t=0; t<STAGE_COUNT; t++) {
+		Histogram *h = &s->stages[t];
+		fprintf(f, "%s\"%s\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+			t ? "," : "", stages[t], h->count, h->count ? h->sum/1e3/h->count : 0.0,
+			quantile(h, 0.5)/1e3, quantile(h, 0.9)/1e3, quantile(h, 0.99)/1e3, quantile(h, 0.999)/1e3, h->max/1e3);
+	}
+	fprintf(f, "}}\n");
+}
+
+static void prometheus(FILE *f, Stats *s, int conns) {
+	static const double bounds[] = {1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+	fprintf(f, "# HELP tiger_connections Open client connections.\n# TYPE tiger_connections gauge\ntiger_connections %d\n", conns);
+	fprintf(f, "# HELP tiger_connections_accepted_total Client connections accepted.\n# TYPE tiger_connections_accepted_total counter\ntiger_connections_accepted_total %lu\n", s->accepted);
+	fprintf(f, "# HELP tiger_requests_total Requests answered.\n# TYPE tiger_requests_total counter\ntiger_requests_total %lu\n", s->requests);
+
+	fprintf(f, "# HELP tiger_responses_total Responses by status code.\n# TYPE tiger_responses_total counter\n");
+	for (int c=0; c<STATS_CODES; c++) {
+		if (s->codes[c]) fprintf(f, "tiger_responses_total{code=\"%d\"} %lu\n", c, s->codes[c]);
+	}
+
+	fprintf(f, "# HELP tiger_cache_lookups_total Files looked up in the file cache.\n# TYPE tiger_cache_lookups_total counter\n");
+	fprintf(f, "tiger_cache_lookups_total{result=\"hit\"} %lu\ntiger_cache_lookups_total{result=\"miss\"} %lu\n", s->cachehits, s->cachemisses);
+	fprintf(f, "# HELP tiger_php_requests_total Requests handed to PHP.\n# TYPE tiger_php_requests_total counter\ntiger_php_requests_total %lu\n", s->php);
+
+	fprintf(f, "# HELP tiger_stage_duration_seconds Time requests spend in each stage.\n# TYPE tiger_stage_duration_seconds histogram\n");
+	for (int t=0; t<STAGE_COUNT; t++) {
+		Histogram *h = &s->stages[t];
+		unsigned long below = 0;
+		int b = 0;
+
+		for (int i=0; i<sizeof(bounds)/sizeof(bounds[0]); i++) {
+			for (; b < STATS_BUCKETS && bucketmax(b) <= bounds[i]*1e9; b++) below += h->buckets[b];
+			fprintf(f, "tiger_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", stages[t], bounds[i], below);
+		}
+		fprintf(f, "tiger_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stages[t], h->count);
+		fprintf(f, "tiger_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stages[t], h->sum/1e9);
+		fprintf(f, "tiger_stage_duration_seconds_count{stage=\"%s\"} %lu\n", stages[t], h->count);
+	}
+}
+
+/* Answer /__tiger/stats (JSON) and /__tiger/metrics (Prometheus); false if CONN asked for something else */
+bool TigerStatsServe(Connection *conn) {
+	const char *path = conn->req.truepath;
+	bool metrics = !strcmp(path, "/__tiger/metrics");
+	unsigned long persecond;
+	Stats *total;
+	char *out;
+	size_t len;
+	FILE *f;
+	int conns;
+
+	if (!stats_enabled || (!metrics && strcmp(path, "/__tiger/stats"))) return false;
+
+	if (!(total = malloc(sizeof(Stats))) || !(f = open_memstream(&out, &len))) {
+		perror("malloc()");
+		exit(1);
+	}
+
+	if (collect(total, &persecond, &conns)) {
+		if (metrics) prometheus(f, total, conns);
+		else json(f, total, persecond, conns);
+	}
+	fclose(f);
+	free(total);
+
+	TigerConnHeader(conn, 200, len, metrics ? "Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n" : "Content-Type: application/json\r\nCache-Control: no-store\r\n");
+	TigerConnBody(conn, out, len);
+	free(out);
+	return true;
+}
@@ -16,6 +16,7 @@
  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -24,18 +25,18 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <dirent.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <signal.h>
-#include <fnmatch.h>
+#include <time.h>
 #include "hirolib.h"
 #include "bns.h"
 #include "server.h"
 #include "librsl.h"
 
-LoadedScript *scripts;
-int nloadedscripts = 1;
+static ScriptTable *scripttable;
 
 bool disable_cache = false;
 bool disable_redirect = false;
@@ -43,24 +44,81 @@ bool disable_error = false;
 uint32_t ip_whitelist = 0;
 uint32_t ip_mask = 0xffffffff;
 
-const char *verbs[] = {"GET","POST","PUT","PATCH","DELETE","HEAD","OPTIONS"};
+extern const char *encodings[];
+extern char *fastcgi_addr;
+extern char rootpath[];
 
 const char *httpcodes[] = {
 	[200]="OK",
+	[201]="Created",
 	[204]="No Content",
 	[206]="Partial Content",
+	[301]="Moved Permanently",
+	[302]="Found",
+	[303]="See Other",
+	[304]="Not Modified",
+	[307]="Temporary Redirect",
+	[308]="Permanent Redirect",
 	[400]="Bad Request",
 	[401]="Unauthorized",
 	[403]="Forbidden",
 	[404]="Not Found",
+	[405]="Method Not Allowed",
+	[413]="Payload Too Large",
+	[416]="Range Not Satisfiable",
 	[418]="I'm A Teapot",
+	[431]="Request Header Fields Too Large",
 	[500]="Internal Server Error",
 	[501]="Not Implemented",
+	[502]="Bad Gateway",
 	[503]="Service Unavailable",
 	[505]="HTTP Version Not Supported",
 	[507]="Insufficient Storage"
 };
 
+const struct {
+	char *ext;
+	char *type;
+} mimetypes[] = {
+	{".html", "text/html"},
+	{".htm", "text/html"},
+	{".css", "text/css"},
+	{".js", "text/javascript"},
+	{".mjs", "text/javascript"},
+	{".json", "application/json"},
+	{".txt", "text/plain"},
+	{".xml", "application/xml"},
+	{".svg", "image/svg+xml"},
+	{".png", "image/png"},
+	{".jpg", "image/jpeg"},
+	{".jpeg", "image/jpeg"},
+	{".gif", "image/gif"},
+	{".webp", "image/webp"},
+	{".ico", "image/x-icon"},
+	{".pdf", "application/pdf"},
+	{".wasm", "application/wasm"},
+	{".woff", "font/woff"},
+	{".woff2", "font/woff2"},
+	{".ttf", "font/ttf"},
+	{".mp3", "audio/mpeg"},
+	{".ogg", "audio/ogg"},
+	{".mp4", "video/mp4"},
+	{".webm", "video/webm"},
+	{".zip", "application/zip"},
+	{".gz", "application/gzip"},
+};
+
+const char *TigerMimeType(const char *path) {
+	const char *ext = strrchr(path, '.');
+	
+	if (ext && !strchr(ext, '/')) {
+		for (int i=0; i<sizeof(mimetypes)/sizeof(mimetypes[0]); i++) {
+			if (!strcasecmp(ext, mimetypes[i].ext)) return mimetypes[i].type;
+		}
+	}
+	return "application/octet-stream";
+}
+
 bool exists(char *path) {
 	FILE *fp = fopen(path, "r");
 	if (fp) {
@@ -70,86 +128,36 @@ bool exists(char *path) {
 	return false;
 }
 
-int TigerSearchScript(char *path, int pathlen) {
-	for (int i=0; i<nloadedscripts; i++) {
-		for (int j=0; j<16; j++) {
-			if (scripts[i].paths[j]) {
-				if (fnmatch(scripts[i].paths[j], path, 0) != FNM_NOMATCH) {
-					return i;
-				}
-			}
-		}
-	}
-	return -1;
-}
+void TigerFreeScripts(ScriptTable *t);
 
-RequestData *TigerParseRequest(const char *const reqbuff, char *rootpath) {
-	RequestData *reqdata = malloc(sizeof(RequestData));
-	char *line;
-	char *tmp;
-	
-	if (!reqdata) {
-		perror("malloc");
-		exit(1);
-	}
-	
-	line = ntoken(reqbuff, "\x0d\x0a", 0);
-	
-	/* If 2nd token doesn't exist error */
-	if (!(tmp = ntoken(line, " ", 2))) {
-		errno=1; return NULL;
-	}
-	
-	/* Read request data */
-	tmp = ntoken(line, " ", 0);
-	strncpy(reqdata->rverb, tmp, 7);
-	
-	tmp = ntoken(line, " ", 1);
-	strncpy(reqdata->path, tmp, 4096);
-	
-	tmp = ntoken(line, " ", 2);
-	strncpy(reqdata->protocol, tmp, 8);
-	
-	free(line);
-	
-	if (!disable_redirect) {
-		if (!strcmp(reqdata->path, "/")) {
-			strcpy(reqdata->path, "/index.html");
-			
-			//check if index.html exists
-			char filename[BUFSIZ];
-			sprintf(filename, "%s/public/index.html", rootpath);
-			if (exists(filename)) {
-				printf("index.html ");
-				sprintf(reqdata->path, "/index.html");
-			} else {
-				//check if index.php exists
-				sprintf(filename, "%s/public/index.php", rootpath);
-				if (exists(filename)) {
-					printf("index.php ");
-					sprintf(reqdata->path, "/index.php");
-				} else {
-					printf("404 ");
-					sprintf(reqdata->path, "/");
-				}
-			}
+/*
+ Index the paths of T and answer requests from it from now on.
+ Workers may still be running scripts of the table it replaces, which is freed once each of them has been back to epoll_wait().
+*/
+void TigerSetScripts(ScriptTable *t) {
+	t->routes = TigerRouteNew();
+	for (int i=0; i<t->nscripts; i++) {
+		for (int j=0; j<16 && t->scripts[i].paths[j]; j++) {
+			TigerRouteAdd(t->routes, t->scripts[i].paths[j], i);
 		}
 	}
-	/* Verify client is using HTTP 1.0 or HTTP 1.1 Protocol and using verb GET, POST, PUT, PATCH, DELETE, OPTIONS, or HEAD*/
-	if (!(startswith(reqdata->protocol, "HTTP/1.0") ||
-		  startswith(reqdata->protocol, "HTTP/1.1"))) {
-		errno=2; printf("(%s) (%s) (%s) (%s)", line,
-				reqdata->rverb, reqdata->path, reqdata->protocol); return 0;
-	} else if ((reqdata->verb = needle(reqdata->rverb, verbs, 7)) < 0) {
-		/* Using invalid verb */
-		errno=3; return 0;
+
+	ScriptTable *old = __atomic_exchange_n(&scripttable, t, __ATOMIC_SEQ_CST);
+	if (old) {
+		TigerWorkersSync();
+		TigerFreeScripts(old);
 	}
-	if (!reqdata) kill(getpid(), SIGSEGV);
-	return reqdata;
+}
+
+/* The script answering PATH, which stays valid until the worker goes back to waiting for events */
+LoadedScript *TigerSearchScript(char *path, int pathlen) {
+	ScriptTable *t = __atomic_load_n(&scripttable, __ATOMIC_SEQ_CST);
+	int i = t ? TigerRouteMatch(t->routes, path) : -1;
+	return i >= 0 ? &t->scripts[i] : NULL;
 }
 
 //Returns a socket fd
-int TigerInit(unsigned short port) {
+int TigerInit(unsigned short port, bool reuseport) {
 	
 	int sock;
 	struct sockaddr_in addr = {
@@ -158,20 +166,27 @@ int TigerInit(unsigned short port) {
 		0
 	};
 	
-	sock = socket(AF_INET, SOCK_STREAM, 0);
+	//Close-on-exec, or every program Tiger starts could accept() on it
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	
 	if (sock == -1) {
 		perror("socket()");
 		exit(127);
 	}
 	
+	int t = 1;
+	
+	/* Let every worker bind its own listener to the same port */
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t))) {
+		perror("setsockopt()");
+		exit(127);
+	}
+	
 	if (bind(sock, &addr, sizeof(addr))) {
 		perror("bind()");
 		exit(127);
 	}
 	
-	int t = 1;
-	
 	if (listen(sock, 4096)) {
 		perror("listen()");
 		exit(127);
@@ -180,60 +195,21 @@ int TigerInit(unsigned short port) {
 	return sock;
 }
 
-loadFile_returnData TigerLoadFile(char *pubpath, char *cachepath) {
-	if (!pubpath) {errno=EINVAL; return (loadFile_returnData){0};};
+/* PATH is relative to public/ and must already be normalized */
+loadFile_returnData TigerLoadFile(char *path) {
+	if (!path) {errno=EINVAL; return (loadFile_returnData){0};};
 	loadFile_returnData data = {0};
+	bool hit;
 
-	FILE *pubfile;
-	FILE *cachefile;
-
-	if (!exists(cachepath) | disable_cache) {
-		//If cached file doesn't exist, cache file
-		pubfile = fopen(pubpath, "r");
-		cachefile = fopen(cachepath, "w");
-		if (!pubfile) { 
-			return (loadFile_returnData){0};
-		}
-		if (!cachefile) {
-			fprintf(stderr, "Unable to create cached file.\n");
-			return (loadFile_returnData){0};
-		}
-
-		data.datalen = filesize(pubfile);
-		
-		if (data.datalen == -1) {
-			perror("filesize()");
-			return (loadFile_returnData){0};
-		}
-		
-		data.data = calloc(1, data.datalen);
-		
-		if (!data.data) {
-			fprintf(stderr, "Unable to allocate %d bytes.\n", data.datalen);
-			perror("malloc()");
-			exit(1);
-		}
-
-		fread(data.data, 1, data.datalen, pubfile);
-		fwrite(data.data, 1, data.datalen, cachefile);
-
-		fclose(pubfile);
-		fclose(cachefile);
-		printf("(Not Cached) ");
-	} else {
-		cachefile = fopen(cachepath, "r");
-
-		data.datalen = filesize(cachefile);
-		data.data = calloc(1, data.datalen);
-		if (!data.data) {
-			perror("malloc()");
-			exit(1);
-		}
-
-		fread(data.data, 1, data.datalen, cachefile);
-		fclose(cachefile);
-		printf("(Cached) ");
+	CacheEntry *entry = TigerCacheGet(path, &hit);
+	if (!entry) {
+		return (loadFile_returnData){0};
 	}
+
+	data.type = hit ? 1 : 2;
+	data.entry = entry;
+	data.data = entry->data;
+	data.datalen = entry->len;
 	return data;
 }
 
@@ -242,88 +218,274 @@ char *defaulthandlertxt[] = {
 	[401] = "Sorry, but you are not authorized to view this resource.",
 	[403] = "Sorry, but you are forbidden from accessing this resource.",
 	[404] = "Sorry, but the requested resource could not be found.",
+	[405] = "Sorry, but this resource does not answer to that method.",
 	[410] = "Sorry, but the requested resource is not and will never be available again.",
+	[413] = "Sorry, but your request was too large.",
+	[416] = "Sorry, but the requested range is not available.",
 	[418] = "Sorry, but this server only brews tea. The server is a teapot.",
+	[431] = "Sorry, but your request had too many headers.",
 	[451] = "Sorry, but the requested resource is not available due to legal reasons.",
 	[500] = "Sorry, but the server had a stroke trying to figure out what to do.",
+	[501] = "Sorry, but this server does not support what your request asks for.",
+	[502] = "Sorry, but the script behind this page did not answer properly.",
 	[503] = "Sorry, but the server is overloaded and cannot handle the request.",
 	[505] = "Sorry, but your HTTP Version was not supported.",
 };
 
-void TigerErrorHandler(int status, char *response, RequestData reqdata, char *rootpath) {;
-	sprintf(response, "HTTP/1.0 %d %s\nServer: Tiger/"TIGER_VERS"\r\n\r\n", status, httpcodes[status]);
-	char filename[BUFSIZ]; //<status>.html
-	sprintf(filename, "/%03d.html", status);
-
-	char public_path[BUFSIZ];
-	char cache_path[BUFSIZ];
+/* Queue the status line and headers; EXTRA is either NULL or a list of CRLF-terminated headers, a negative CONTENTLEN leaves out Content-Length */
+void TigerConnHeader(Connection *conn, int status, long contentlen, const char *extra) {
+	char buff[BUFSIZ];
+	char lenhdr[40] = "";
 	
-	loadFile_returnData data = TigerLoadFile(public_path, cache_path);
+	conn->status = status;
+	if (contentlen >= 0) snprintf(lenhdr, sizeof lenhdr, "Content-Length: %ld\r\n", contentlen);
+	int len = snprintf(buff, sizeof buff,
+		"HTTP/1.1 %d %s\r\nServer: Tiger/"TIGER_VERS"\r\n%sConnection: %s\r\n%s\r\n",
+		status, (status < sizeof(httpcodes)/sizeof(httpcodes[0]) && httpcodes[status]) ? httpcodes[status] : "Unknown", lenhdr, conn->keepalive ? "keep-alive" : "close", extra ? extra : "");
+	
+	TigerConnWrite(conn, buff, min(len, (int)sizeof(buff)-1));
+}
+
+/* Precompute the validators and the 200 response header of a freshly loaded entry */
+void TigerBuildHeader(CacheEntry *entry) {
+	const char *type = TigerMimeType(entry->path);
+	char coding[64] = "";
+	struct tm tm;
 	
-	if (errno) {
-		//can't access error handler
-		sprintf(response, "%s<html><body><h1>Error %03d</h1><p>%s</p></body></html>", response, status, defaulthandlertxt[status]);
-		return;
+	/* Variants have their own tag, and the plain file has to tell caches that it has them */
+	if (entry->encoding) {
+		snprintf(entry->etag, sizeof entry->etag, "\"%lx-%lx-%lx-%s\"",
+			(unsigned long)entry->ino, (unsigned long)entry->len, (unsigned long)entry->mtime, encodings[entry->encoding]);
+		snprintf(coding, sizeof coding, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", encodings[entry->encoding]);
 	} else {
-		strncat(response, data.data, data.datalen);
-		return;
+		snprintf(entry->etag, sizeof entry->etag, "\"%lx-%lx-%lx\"",
+			(unsigned long)entry->ino, (unsigned long)entry->len, (unsigned long)entry->mtime);
+		snprintf(coding, sizeof coding, "Accept-Ranges: bytes\r\n%s", TigerCompressible(type) ? "Vary: Accept-Encoding\r\n" : "");
 	}
+	gmtime_r(&entry->mtime, &tm);
+	strftime(entry->lastmod, sizeof entry->lastmod, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	
+	entry->headerlen = snprintf(entry->header, sizeof entry->header,
+		"HTTP/1.1 200 OK\r\nServer: Tiger/"TIGER_VERS"\r\nContent-Type: %s\r\nContent-Length: %ld\r\n%sETag: %s\r\nLast-Modified: %s\r\n",
+		type, entry->len, coding, entry->etag, entry->lastmod);
 }
 
-int TigerCallPHP(char *source_path, char *output_path, RequestData data, loadFile_returnData *output) {
-	char *php_argv_s = "";
-	char *php_argv;
-	char *command;
-	void *tmp;
-
-	//"php ø ø > ø"
-	//4+1+3+1 = 9
-	//9+strlen(source_path)+strlen(php_argv)+strlen(output_path)
-
-	php_argv_s = ntoken(data.path, "?", 1);
+/* Does any entity tag in the If-None-Match list V match ETAG? Comparison is weak, W/ prefixes are ignored */
+static bool etagmatch(const char *v, int len, const char *etag) {
+	const char *end = v+len;
+	int elen = strlen(etag);
+	
+	while (v < end) {
+		while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+		if (end-v >= 2 && v[0] == 'W' && v[1] == '/') v += 2;
+		const char *t = v;
+		while (v < end && *v != ',') v++;
+		const char *e = v;
+		while (e > t && (e[-1] == ' ' || e[-1] == '\t')) e--;
+		if ((e-t == 1 && *t == '*') || (e-t == elen && !memcmp(t, etag, elen))) return true;
+	}
+	return false;
+}
 
-	if (!php_argv_s) {
-		php_argv = "";
-		goto execphp;
+/* Should a GET or HEAD for ENTRY be answered with 304? If-None-Match takes precedence over If-Modified-Since */
+bool TigerNotModified(Connection *conn, CacheEntry *entry) {
+	RequestData *req = &conn->req;
+	const char *buf = conn->reqbuff;
+	Slice *v;
+	
+	if (req->verb != VERB_GET && req->verb != VERB_HEAD) return false;
+	
+	if ((v = TigerHeader(req, HDR_IF_NONE_MATCH))) return etagmatch(buf+v->off, v->len, entry->etag);
+	
+	if ((v = TigerHeader(req, HDR_IF_MODIFIED_SINCE))) {
+		char date[64];
+		struct tm tm = {0};
+		
+		/* Clients usually echo Last-Modified back verbatim */
+		if (v->len == strlen(entry->lastmod) && !memcmp(buf+v->off, entry->lastmod, v->len)) return true;
+		
+		snprintf(date, sizeof date, "%.*s", v->len, buf+v->off);
+		if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return false;
+		return entry->mtime <= timegm(&tm);
 	}
+	
+	return false;
+}
 
-	php_argv = malloc(strlen(php_argv_s)+1);
-	memset(php_argv, 0, strlen(php_argv_s)+1);
+/* 304 carries the validators but no body */
+void TigerConnNotModified(Connection *conn, CacheEntry *entry) {
+	char extra[128];
+	
+	bool vary = entry->encoding || TigerCompressible(TigerMimeType(entry->path));
+	
+	snprintf(extra, sizeof extra, "ETag: %s\r\nLast-Modified: %s\r\n%s", entry->etag, entry->lastmod, vary ? "Vary: Accept-Encoding\r\n" : "");
+	TigerConnHeader(conn, 304, -1, extra);
+}
 
+#define MAX_RANGES 8 //Each part takes two output segments
+#define RANGE_BOUNDARY "TIGER-BYTERANGES-6d3f0a9c1b"
 
-	for (int i=0; i<strlen(php_argv_s); i++) {
-		switch (php_argv_s[i]) {
-		case '&':
-			php_argv[i] = ' ';
-			break;
-		default:
-			php_argv[i] = php_argv_s[i];
+/*
+ Parse a bytes= range set against a file of SIZE bytes into RANGES (first and last byte).
+ Returns how many ranges are satisfiable, or -1 if the header should be ignored.
+*/
+static int parseranges(const char *v, int len, long size, long ranges[][2]) {
+	const char *end = v+len;
+	long total = 0;
+	int n = 0;
+	
+	if (len < 6 || strncasecmp(v, "bytes=", 6)) return -1;
+	v += 6;
+	
+	while (v < end) {
+		long first = -1, last = -1;
+		
+		while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+		if (v == end) break;
+		
+		if (*v >= '0' && *v <= '9') {
+			for (first = 0; v < end && *v >= '0' && *v <= '9'; v++) {
+				if (first <= size) first = first*10 + *v-'0';
+			}
+		}
+		if (v == end || *v++ != '-') return -1;
+		if (v < end && *v >= '0' && *v <= '9') {
+			for (last = 0; v < end && *v >= '0' && *v <= '9'; v++) {
+				if (last > size) last = size;
+				else last = last*10 + *v-'0';
+			}
+		}
+		while (v < end && (*v == ' ' || *v == '\t')) v++;
+		if (v < end && *v != ',') return -1;
+		
+		if (first < 0) {
+			//Suffix range: the last LAST bytes
+			if (last < 0) return -1;
+			if (!last) continue;
+			first = max(size-last, 0);
+			last = size-1;
+		} else {
+			if (last >= 0 && last < first) return -1;
+			if (first >= size) continue;
+			if (last < 0 || last >= size) last = size-1;
 		}
+		
+		//Too many parts or more bytes than the file has: just send the whole file
+		total += last-first+1;
+		if (n == MAX_RANGES || total > size) return -1;
+		ranges[n][0] = first;
+		ranges[n][1] = last;
+		n++;
 	}
+	
+	return n;
+}
 
-execphp:
-	command = malloc(9+strlen(source_path)+strlen(php_argv)+strlen(output_path));
-	sprintf(command, "php %s %s > %s", source_path, php_argv, output_path);
+/* Does If-Range still name ENTRY? It must match strongly, by ETag or by the exact Last-Modified date */
+static bool ifrangematch(const char *v, int len, CacheEntry *entry) {
+	const char *val = v[0] == '"' ? entry->etag : entry->lastmod;
+	return len == strlen(val) && !memcmp(v, val, len);
+}
 
-	if (system(command)) {
-		return false;
+/* Answer a Range request for ENTRY with 206 or 416; returns false if the whole file should be sent instead */
+bool TigerConnRange(Connection *conn, CacheEntry *entry) {
+	RequestData *req = &conn->req;
+	const char *buf = conn->reqbuff;
+	long ranges[MAX_RANGES][2];
+	char extra[BUFSIZ];
+	Slice *v, *ifrange;
+	int n;
+	
+	if (req->verb != VERB_GET || !(v = TigerHeader(req, HDR_RANGE))) return false;
+	if ((ifrange = TigerHeader(req, HDR_IF_RANGE)) && !ifrangematch(buf+ifrange->off, ifrange->len, entry)) return false;
+	if ((n = parseranges(buf+v->off, v->len, entry->len, ranges)) < 0) return false;
+	
+	if (!n) {
+		snprintf(extra, sizeof extra, "Content-Range: bytes */%ld\r\n", entry->len);
+		TigerConnHeader(conn, 416, 0, extra);
+		return true;
 	}
+	
+	const char *type = TigerMimeType(entry->path);
+	
+	if (n == 1) {
+		snprintf(extra, sizeof extra, "Content-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\nETag: %s\r\nLast-Modified: %s\r\n",
+			type, ranges[0][0], ranges[0][1], entry->len, entry->etag, entry->lastmod);
+		TigerConnHeader(conn, 206, ranges[0][1]-ranges[0][0]+1, extra);
+		TigerConnBodyEntry(conn, entry, ranges[0][0], ranges[0][1]-ranges[0][0]+1);
+		return true;
+	}
+	
+	/* multipart/byteranges: each part is a small header followed by its slice of the file */
+	char parts[MAX_RANGES][256];
+	int partlen[MAX_RANGES];
+	static const char closing[] = "\r\n--"RANGE_BOUNDARY"--\r\n";
+	long total = sizeof(closing)-1;
+	
+	for (int i=0; i<n; i++) {
+		partlen[i] = snprintf(parts[i], sizeof parts[i], "\r\n--"RANGE_BOUNDARY"\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			type, ranges[i][0], ranges[i][1], entry->len);
+		partlen[i] = min(partlen[i], (int)sizeof(parts[i])-1);
+		total += partlen[i] + ranges[i][1]-ranges[i][0]+1;
+	}
+	
+	snprintf(extra, sizeof extra, "Content-Type: multipart/byteranges; boundary="RANGE_BOUNDARY"\r\nETag: %s\r\nLast-Modified: %s\r\n",
+		entry->etag, entry->lastmod);
+	TigerConnHeader(conn, 206, total, extra);
+	
+	for (int i=0; i<n; i++) {
+		TigerConnBody(conn, parts[i], partlen[i]);
+		TigerConnBodyEntry(conn, entry, ranges[i][0], ranges[i][1]-ranges[i][0]+1);
+	}
+	TigerConnBody(conn, closing, sizeof(closing)-1);
+	return true;
+}
+
+void TigerErrorHandler(int status, Connection *conn, char *rootpath) {
+	char response[BUFSIZ];
+	char filename[BUFSIZ]; //<status>.html
+	sprintf(filename, "/%03d.html", status);
 
-	FILE *fp = fopen(output_path, "r");
+	loadFile_returnData data = {0};
+	if (!disable_error) data = TigerLoadFile(filename);
+	
+	if (!data.entry) {
+		//can't access error handler; statuses without a text of their own get the generic one for their class
+		const char *text = status < sizeof(defaulthandlertxt)/sizeof(defaulthandlertxt[0]) ? defaulthandlertxt[status] : NULL;
+		if (!text) text = defaulthandlertxt[status < 500 ? 400 : 500];
+		int len = snprintf(response, sizeof response, "<html><body><h1>Error %03d</h1><p>%s</p></body></html>", status, text);
+		TigerConnHeader(conn, status, len, "Content-Type: text/html\r\n");
+		TigerConnBody(conn, response, len);
+	} else {
+		TigerConnHeader(conn, status, data.datalen, "Content-Type: text/html\r\n");
+		TigerConnBodyEntry(conn, data.entry, 0, data.datalen);
+		TigerCacheRelease(data.entry);
+	}
+}
 
-	char *htmlfile = malloc(filesize(fp));
-								   
-	if (!htmlfile) {
-		perror("malloc");
-		exit(255);
+/* Run SOURCE_PATH with the php CLI, one argument per &-separated QUERY field, streaming its output to CONN */
+bool TigerCallPHP(Connection *conn, char *source_path, char *query, struct PageFill *fill) {
+	char *argv[64] = {"php", source_path};
+	int argc = 2;
+	char *save;
+	
+	for (char *arg = strtok_r(query, "&", &save); arg && argc < 63; arg = strtok_r(NULL, "&", &save)) {
+		argv[argc++] = arg;
 	}
+	argv[argc] = NULL;
 	
-	fread(htmlfile, 1, filesize(fp), fp);
-	output->data = htmlfile;
-	output->datalen = filesize(fp);
-
-	fclose(fp);
+	return TigerSpawnStart(conn, argv, fill);
+}
 
-	free(command);
-	return true;
-};
+/* Run the script CONN asked for, through FastCGI if there is a server; FILL, if set, gets a copy of the response */
+bool TigerRunPHP(Connection *conn, struct PageFill *fill) {
+	RequestData *req = &conn->req;
+	char path[PATH_MAX];
+	char query[BUFSIZ];
+	
+	if (fastcgi_addr) return TigerFcgiStart(conn, fill);
+	
+	snprintf(path, sizeof path, "%s/public%s", rootpath, req->truepath);
+	snprintf(query, sizeof query, "%.*s", req->query.len, conn->reqbuff+req->query.off);
+	return TigerCallPHP(conn, path, query, fill);
+}
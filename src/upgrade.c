@@ -0,0 +1,254 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ Graceful restarts: on SIGUSR2 Tiger starts its binary again, which may have been replaced in the meantime, and
+ hands it the listening sockets over a Unix socket. The accept queues are never closed, so no connection is refused;
+ once the new process is up, this one stops accepting, lets its connections finish and exits.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include "server.h"
+#include "daemon.h"
+
+#define UPGRADE_ENV "TIGER_UPGRADE_FD" //Set in the new process to its end of the channel
+#define UPGRADE_FD 3 //Where the new process finds it
+#define UPGRADE_MAX_FDS 253 //SCM_MAX_FD
+#define UPGRADE_TIMEOUT 10000 //Milliseconds the new process has to get ready
+#define DRAIN_TIMEOUT 30 //Seconds connections get to finish before the old process exits anyway
+
+extern Worker *workers;
+extern int nworkers;
+extern char **environ;
+extern bool create_daemon;
+
+bool draining = false; //Handed over, connections are closed as soon as they are done
+
+static char selfexe[PATH_MAX];
+static char startdir[PATH_MAX];
+static char **savedargv;
+static int upgradefd = -1; //Channel to the process being replaced
+
+/* Remember how this process was started, before anything changes the directory */
+void TigerUpgradeInit(char **argv) {
+	char *fd = getenv(UPGRADE_ENV);
+
+	savedargv = argv;
+	if (!getcwd(startdir, sizeof startdir) || !realpath("/proc/self/exe", selfexe)) selfexe[0] = 0;
+
+	if (fd) {
+		upgradefd = strtol(fd, NULL, 10);
+		fcntl(upgradefd, F_SETFD, FD_CLOEXEC);
+		unsetenv(UPGRADE_ENV);
+	}
+}
+
+/* Whether this process is taking over from another one */
+bool TigerUpgrading() {
+	return upgradefd >= 0;
+}
+
+/* The listeners of the process being replaced, up to MAX of them in FDS; returns how many */
+int TigerInheritListeners(int *fds, int max) {
+	char byte;
+	char control[CMSG_SPACE(UPGRADE_MAX_FDS*sizeof(int))];
+	struct iovec iov = {&byte, 1};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control};
+	struct cmsghdr *cmsg;
+	int n = 0;
+
+	if (upgradefd < 0) return 0;
+
+	if (recvmsg(upgradefd, &msg, MSG_CMSG_CLOEXEC) <= 0 || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+		cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "Unable to take over the listeners\n");
+		exit(127);
+	}
+
+	n = (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+	memcpy(fds, CMSG_DATA(cmsg), min(n, max)*sizeof(int));
+	for (int i=max; i<n; i++) close(((int *)CMSG_DATA(cmsg))[i]);
+
+	printf("Took over %d listeners\n", min(n, max));
+	return min(n, max);
+}
+
+/* Tell the process being replaced that this one accepts connections now */
+void TigerUpgradeReady() {
+	if (upgradefd < 0) return;
+	if (write(upgradefd, "", 1) != 1) perror("write()");
+	close(upgradefd);
+	upgradefd = -1;
+}
+
+/* Stop accepting and wait for the workers' connections to finish, then exit */
+static void drain(Worker *all) {
+	struct timespec pause = {0, 100000000};
+
+	__atomic_store_n(&draining, true, __ATOMIC_SEQ_CST);
+	for (int i=0; i<nworkers; i++) eventfd_write(all[i].wakefd, 1);
+
+	for (int t=0; t<DRAIN_TIMEOUT*10; t++) {
+		int open = 0;
+		for (int i=0; i<nworkers; i++) open += __atomic_load_n(&all[i].nconns, __ATOMIC_RELAXED);
+		if (!open) break;
+		nanosleep(&pause, NULL);
+	}
+
+	TigerLogFlush();
+	printf("Drained, exiting\n");
+	fflush(stdout);
+	exit(0);
+}
+
+/* Start the binary again with the same arguments and hand it the listeners; false if it didn't take over */
+static bool upgrade() {
+	Worker *all = __atomic_load_n(&workers, __ATOMIC_ACQUIRE);
+	char control[CMSG_SPACE(UPGRADE_MAX_FDS*sizeof(int))];
+	char env[64], ack;
+	int sv[2], nenv = 0;
+	pid_t pid;
+
+	if (!all || !selfexe[0] || nworkers > UPGRADE_MAX_FDS) {
+		fprintf(stderr, "Unable to restart gracefully\n");
+		return false;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair()");
+		return false;
+	}
+
+	//Everything the child needs is ready before the fork, it only execs
+	while (environ[nenv]) nenv++;
+	char **envp = malloc((nenv+2)*sizeof(char *));
+	if (!envp) {
+		perror("malloc()");
+		exit(1);
+	}
+	memcpy(envp, environ, nenv*sizeof(char *));
+	snprintf(env, sizeof env, UPGRADE_ENV"=%d", UPGRADE_FD);
+	envp[nenv] = env;
+	envp[nenv+1] = NULL;
+
+	printf("Restarting %s\n", selfexe);
+	fflush(stdout);
+
+	if (!(pid = fork())) {
+		//Client sockets must not outlive this process in the new one, only the channel is passed on
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		dup2(sv[1], UPGRADE_FD);
+		fcntl(UPGRADE_FD, F_SETFD, 0);
+		close_range(UPGRADE_FD+1, ~0U, 0);
+		if (chdir(startdir)) _exit(127);
+		execve(selfexe, savedargv, envp);
+		_exit(127);
+	}
+	free(envp);
+	close(sv[1]);
+	if (pid < 0) {
+		perror("fork()");
+		close(sv[0]);
+		return false;
+	}
+
+	struct iovec iov = {"", 1};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(nworkers*sizeof(int))};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nworkers*sizeof(int));
+	for (int i=0; i<nworkers; i++) ((int *)CMSG_DATA(cmsg))[i] = all[i].serversock;
+
+	struct pollfd pfd = {sv[0], POLLIN};
+	if (sendmsg(sv[0], &msg, 0) < 0 || poll(&pfd, 1, UPGRADE_TIMEOUT) != 1 || read(sv[0], &ack, 1) != 1) {
+		//It never got to accepting, this process carries on as if nothing happened
+		fprintf(stderr, "The new process didn't start, still serving\n");
+		close(sv[0]);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return false;
+	}
+	close(sv[0]);
+
+	if (create_daemon) daemon_pidfile(pid);
+	printf("Handed over to PID %d, draining\n", pid);
+	fflush(stdout);
+	drain(all);
+	return true;
+}
+
+static void signals(sigset_t *set) {
+	sigemptyset(set);
+	sigaddset(set, SIGUSR2);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGINT);
+}
+
+static void *upgrademain(void *arg) {
+	sigset_t set;
+	int sig;
+
+	signals(&set);
+	while (!sigwait(&set, &sig)) {
+		if (sig == SIGUSR2) {
+			upgrade();
+			continue;
+		}
+		//Asked to stop: the access log still has the last requests
+		TigerLogFlush();
+		exit(0);
+	}
+	return NULL;
+}
+
+/*
+ Restart gracefully on SIGUSR2, and exit with the access log written on SIGTERM and SIGINT.
+ Must be called before any other thread is started, which inherit the blocked signals; so do the programs Tiger starts, which unblock them.
+*/
+void TigerUpgradeListen() {
+	pthread_t thread;
+	sigset_t set;
+	int err;
+
+	signals(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if ((err = pthread_create(&thread, NULL, upgrademain, NULL))) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+		return;
+	}
+	pthread_detach(thread);
+}
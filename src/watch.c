@@ -0,0 +1,241 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ Content is deployed while Tiger runs: a thread watches public/ and scripts/ with inotify,
+ drops cached copies of the files that change and swaps in a freshly loaded script table.
+*/
+
+#define _GNU_SOURCE
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include "bns.h"
+#include "server.h"
+#include "librsl.h"
+
+#define WATCH_SETTLE 100 //Milliseconds scripts/ has to stay quiet before it is reloaded, deploys change several files at once
+
+#define PUBLIC_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+#define SCRIPTS_EVENTS (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define ROOT_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+ScriptTable *TigerLoadScripts();
+void TigerSetScripts(ScriptTable *t);
+
+extern char rootpath[];
+extern bool cache_watched;
+
+static int ifd = -1;
+static int rootwd = -1, scriptswd = -1;
+static char **dirs; //Path under public/ of each watch descriptor, "" for public/ itself
+static int ndirs;
+
+static void setdir(int wd, const char *path) {
+	if (wd >= ndirs) {
+		int n = max(wd+1, ndirs*2);
+		if (!(dirs = realloc(dirs, n*sizeof(char *)))) {
+			perror("realloc()");
+			exit(1);
+		}
+		memset(dirs+ndirs, 0, (n-ndirs)*sizeof(char *));
+		ndirs = n;
+	}
+	free(dirs[wd]);
+	dirs[wd] = strdup(path);
+}
+
+/* Watch the directory PATH under public/ and everything below it; false if some of it can't be watched */
+static bool addtree(const char *path) {
+	char full[PATH_MAX], sub[PATH_MAX];
+	struct dirent *ent;
+	bool ok = true;
+	DIR *dir;
+	int wd;
+
+	snprintf(full, sizeof full, "%spublic%s", rootpath, path);
+	if ((wd = inotify_add_watch(ifd, full, PUBLIC_EVENTS)) < 0) {
+		//Gone again already, which its own event reports
+		return errno == ENOENT || errno == ENOTDIR;
+	}
+	setdir(wd, path);
+
+	if (!(dir = opendir(full))) return true;
+	while ((ent = readdir(dir))) {
+		struct stat st;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+		snprintf(sub, sizeof sub, "%s/%s", path, ent->d_name);
+		if (ent->d_type == DT_UNKNOWN) {
+			snprintf(full, sizeof full, "%spublic%s", rootpath, sub);
+			if (lstat(full, &st) || !S_ISDIR(st.st_mode)) continue;
+		} else if (ent->d_type != DT_DIR) {
+			continue;
+		}
+		ok &= addtree(sub);
+	}
+	closedir(dir);
+	return ok;
+}
+
+/* Stop watching the directory PATH under public/ and what was below it */
+static void removetree(const char *path) {
+	int len = strlen(path);
+
+	for (int wd=0; wd<ndirs; wd++) {
+		if (dirs[wd] && !strncmp(dirs[wd], path, len) && (!dirs[wd][len] || dirs[wd][len] == '/')) {
+			inotify_rm_watch(ifd, wd);
+			free(dirs[wd]);
+			dirs[wd] = NULL;
+		}
+	}
+}
+
+/*
+ Watch everything from scratch. Until the watches are in place changes can't be seen,
+ so whatever is cached is dropped afterwards and entries are checked against the disk if some directory can't be watched.
+*/
+static void rewatch() {
+	char path[PATH_MAX];
+	bool ok;
+
+	__atomic_store_n(&cache_watched, false, __ATOMIC_RELAXED);
+
+	if (ifd >= 0) close(ifd);
+	for (int wd=0; wd<ndirs; wd++) {
+		free(dirs[wd]);
+		dirs[wd] = NULL;
+	}
+
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		perror("inotify_init1()");
+		return;
+	}
+
+	rootwd = inotify_add_watch(ifd, rootpath, ROOT_EVENTS);
+	snprintf(path, sizeof path, "%sscripts", rootpath);
+	scriptswd = inotify_add_watch(ifd, path, SCRIPTS_EVENTS);
+	if (!(ok = addtree(""))) fprintf(stderr, "Not every directory in public/ can be watched, cached files are checked against the disk instead\n");
+
+	TigerCacheInvalidate("", true);
+	TigerPagePurge();
+	__atomic_store_n(&cache_watched, ok, __ATOMIC_RELAXED);
+}
+
+/* Handle EV, about something in public/; false if everything has to be watched again */
+static bool publicevent(struct inotify_event *ev) {
+	char path[PATH_MAX];
+
+	if (ev->mask & IN_IGNORED) {
+		if (ev->wd < ndirs) {
+			free(dirs[ev->wd]);
+			dirs[ev->wd] = NULL;
+		}
+		return true;
+	}
+	if (ev->wd >= ndirs || !dirs[ev->wd] || !ev->len) return true;
+
+	snprintf(path, sizeof path, "%s/%s", dirs[ev->wd], ev->name);
+
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			if (!addtree(path)) return false;
+		} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			removetree(path);
+		}
+		TigerCacheInvalidate(path, true);
+		TigerPagePurge();
+		return true;
+	}
+
+	TigerCacheInvalidate(path, false);
+	//Scripts include each other, any of their responses may have changed
+	if (endswith(path, ".php")) TigerPagePurge();
+	return true;
+}
+
+static void *watchmain(void *arg) {
+	char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool reload = false;
+
+	while (true) {
+		struct pollfd pfd = {ifd, POLLIN};
+		int n = poll(&pfd, 1, reload ? WATCH_SETTLE : -1);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("poll()");
+			return NULL;
+		}
+
+		if (!n) {
+			reload = false;
+			printf("Reloading scripts\n");
+			TigerSetScripts(TigerLoadScripts());
+			continue;
+		}
+
+		ssize_t len = read(ifd, buf, sizeof buf);
+		for (char *p = buf; len > 0 && p < buf+len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			//Lost events, or public/ or scripts/ themselves replaced, e.g. by switching a symlink
+			if (ev->mask & IN_Q_OVERFLOW || (ev->wd == rootwd && ev->len && (!strcmp(ev->name, "public") || !strcmp(ev->name, "scripts")))) {
+				rewatch();
+				reload = true;
+				break;
+			}
+
+			if (ev->wd == rootwd) continue;
+			if (ev->wd == scriptswd) {
+				if (ev->len && (endswith(ev->name, ".bns") || endswith(ev->name, ".nsb"))) reload = true;
+				continue;
+			}
+			if (!publicevent(ev)) {
+				rewatch();
+				break;
+			}
+		}
+	}
+}
+
+/* Start watching public/ and scripts/; without inotify, cached files are still checked against the disk every second */
+void TigerWatch() {
+	pthread_t thread;
+	int err;
+
+	rewatch();
+	if (ifd < 0) return;
+
+	if ((err = pthread_create(&thread, NULL, watchmain, NULL))) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+		__atomic_store_n(&cache_watched, false, __ATOMIC_RELAXED);
+		return;
+	}
+	pthread_detach(thread);
+}
@@ -0,0 +1,119 @@
+/*
+ Tiger, a web server built for being really fast and powerful.
+ Copyright (C) 2023 kevidryon2
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "server.h"
+
+Worker *workers;
+int nworkers = 1;
+
+static void *workermain(void *arg) {
+	TigerEventLoop(arg);
+	return NULL;
+}
+
+static void pinworker(Worker *worker) {
+	cpu_set_t set;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpus < 1) ncpus = 1;
+
+	CPU_ZERO(&set);
+	CPU_SET(worker->id % ncpus, &set);
+
+	int err = pthread_setaffinity_np(worker->thread, sizeof(set), &set);
+	if (err) fprintf(stderr, "Unable to pin worker %d: %s\n", worker->id, strerror(err));
+}
+
+/* Every worker owns a SO_REUSEPORT listener and an event loop; the kernel spreads connections between them */
+void TigerStartWorkers(unsigned short port, int n, bool pin) {
+	Worker *all;
+	int inherited[256];
+	int ninherited = TigerInheritListeners(inherited, 256);
+
+	//Every listener taken over needs a worker, or connections queued on it would never be accepted
+	nworkers = max(max(n, 1), ninherited);
+	all = calloc(nworkers, sizeof(Worker));
+
+	if (!all) {
+		perror("calloc()");
+		exit(1);
+	}
+
+	for (int i=0; i<nworkers; i++) {
+		all[i].id = i;
+		all[i].log = TigerLogRing();
+		all[i].stats = TigerStatsNew();
+		if (!ninherited) all[i].serversock = TigerInit(port, nworkers > 1);
+		else if (i < ninherited) all[i].serversock = inherited[i];
+		else all[i].serversock = fcntl(inherited[i % ninherited], F_DUPFD_CLOEXEC, 0);
+	}
+	__atomic_store_n(&workers, all, __ATOMIC_RELEASE);
+	TigerUpgradeReady();
+
+	/* A single worker runs on the main thread */
+	if (nworkers == 1) {
+		workers[0].thread = pthread_self();
+		if (pin) pinworker(&workers[0]);
+		TigerEventLoop(&workers[0]);
+		return;
+	}
+
+	for (int i=0; i<nworkers; i++) {
+		int err = pthread_create(&workers[i].thread, NULL, workermain, &workers[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+			exit(127);
+		}
+		if (pin) pinworker(&workers[i]);
+	}
+
+	printf("Started %d workers.\n", nworkers);
+	fflush(stdout);
+
+	for (int i=0; i<nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+}
+
+/*
+ Wait until every worker has gone back to waiting for events since the call, or is waiting right now.
+ Whatever was unpublished before the call can be freed afterwards, no request still uses it.
+*/
+void TigerWorkersSync() {
+	Worker *all = __atomic_load_n(&workers, __ATOMIC_ACQUIRE);
+	struct timespec pause = {0, 1000000};
+
+	if (!all) return;
+
+	unsigned long seen[nworkers];
+	for (int i=0; i<nworkers; i++) seen[i] = __atomic_load_n(&all[i].epoch, __ATOMIC_SEQ_CST);
+
+	for (int i=0; i<nworkers; i++) {
+		while (!(seen[i] & 1) && __atomic_load_n(&all[i].epoch, __ATOMIC_SEQ_CST) == seen[i]) nanosleep(&pause, NULL);
+	}
+}
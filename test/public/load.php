@@ -0,0 +1,6 @@
+<?php
+
+// Fixed output for bench/load.py, which compares it byte for byte; computed so only a script that ran produces it
+for ($i = 1; $i <= 16; $i++) {
+	echo "tiger ", $i*$i, "\n";
+}